@@ -0,0 +1,2265 @@
+/*
+  Pofo transfer library, see pofo.h for an overview.
+
+  The protocol code was factored out of transfolio.c. Instead of exiting,
+  every function reports errors with a POFO_STATUS and a text that can be
+  retrieved with pofoErrorText().
+*/
+
+#include "pofo.h"
+
+#define PAYLOAD_BUFSIZE   60000
+#define CONTROL_BUFSIZE     100
+#define LIST_BUFSIZE       2000
+#define FRAME_OVERHEAD        4        /* Acknowledge, length (2), checksum */
+#define TAR_BLOCKSIZE       512
+#define TAR_NAME_LEN        256
+#define ERROR_TEXT_LEN      128
+#define TEXT_BUFSIZE       4096        /* Staging buffer of the text conversion */
+#define SPIN_CHECK         4096        /* Port reads between two looks at the clock */
+#define PROBE_MS            500        /* Time the Portfolio has to answer a probe */
+#define PROBE_PAUSE_MS      100        /* First pause between two probes */
+#define PROBE_MAX_PAUSE_MS 2000        /* Pauses double up to this limit */
+#define SYNC_SHIFTS          64        /* Bytes read before the link counts as half synchronized */
+#define PLAN_BLOCKSIZE   0x7000        /* Payload block size assumed by pofoPlan() */
+#define HASH_LEN             32        /* SHA-256 */
+
+#include <stdio.h>                     /* printf etc. */
+#include <stdlib.h>                    /* strtol, malloc */
+#include <string.h>                    /* strncpy, strlen */
+#include <stdarg.h>                    /* va_list */
+#include <errno.h>
+#include <sys/stat.h>                  /* stat */
+#include <time.h>                      /* usleep / nanosleep */
+#if defined(__DMC__)
+#include <direct.h>
+#else
+#include <unistd.h>                    /* usleep */
+#endif
+#if defined(POFO_THREADS)
+#include <pthread.h>
+#endif
+#if !defined(S_ISDIR)
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+#endif
+
+#if defined(PPDEV)
+ #include <sys/ioctl.h>
+ #include <fcntl.h>                     /* open */
+ #include <linux/ppdev.h>               /* Parallel port device */
+#elif __DMC__
+ #if defined(DIRECTIO)
+ #include <dos.h>                       /* Direct port access for DOS */
+ #else
+ #include <windef.h>
+ #include <winbase.h>
+ /* prototype (function typedef) for DLL function Inp32: */
+ typedef short _stdcall (*inpfuncPtr)(short portaddr);
+ typedef void _stdcall (*oupfuncPtr)(short portaddr, short datum);
+ #endif
+#elif defined(RASPIWIRING)
+ #include <wiringPi.h>
+#else
+ #include <sys/io.h>                    /* Direct port access for Linux */
+#endif
+
+#if defined(RASPIWIRING)
+//default GPIO pins
+static const unsigned int wiringClkOut = 7; //GPIO07 pin 7
+                                          //GND    pin 9
+static const unsigned int wiringBitOut = 0; //GPIO00 pin 11
+static const unsigned int wiringClkIn  = 2; //GPIO02 pin 13
+static const unsigned int wiringBitIn  = 3; //GPIO03 pin 15
+#endif
+
+typedef enum {
+	VERB_QUIET = 0,
+	VERB_ERRORS,
+	VERB_COUNTER,
+	VERB_FLOWCONTROL
+} VERBOSITY;
+
+
+static const unsigned char transmitInitTemplate[11] =
+	{ /* Offset 0: Funktion */
+		0x03, 0x00, 0x70, 0x0C, 0x7A, 0x21, 0x32,
+		/* Offset 7: Dateilaenge */
+		0, 0, 0, 0
+		/* Offset 11: Pfad */
+	};
+
+static const unsigned char transmitOverwrite[3] = { 0x05, 0x00, 0x70 };
+
+static const unsigned char transmitCancel[3] = { 0x00, 0x00, 0x00 };
+
+
+static const unsigned char receiveInitTemplate[3] =
+	{ 0x06,         /* Offset 0: Funktion */
+		0x00, 0x70    /* Offset 2: Puffergroesse = 28672 Byte */
+									/* Offset 3: Pfad */
+	};
+
+static const unsigned char receiveFinish[3] = { 0x20, 0x00, 0x03 };
+
+
+/*
+	Code page 437 value of each ISO 8859-1 character from 0xA0 on.
+	Characters that do not exist on the Portfolio are mapped to 0.
+*/
+static const unsigned char latin1ToCp437[96] =
+	{ 0xFF, 0xAD, 0x9B, 0x9C,    0, 0x9D,    0,    0,   /* A0 */
+		   0,    0, 0xA6, 0xAE, 0xAA,    0,    0,    0,
+		0xF8, 0xF1, 0xFD,    0,    0, 0xE6,    0, 0xFA,   /* B0 */
+		   0,    0, 0xA7, 0xAF, 0xAC, 0xAB,    0, 0xA8,
+		   0,    0,    0,    0, 0x8E, 0x8F, 0x92, 0x80,   /* C0 */
+		   0, 0x90,    0,    0,    0,    0,    0,    0,
+		   0, 0xA5,    0,    0,    0,    0, 0x99,    0,   /* D0 */
+		   0,    0,    0,    0, 0x9A,    0,    0, 0xE1,
+		0x85, 0xA0, 0x83,    0, 0x84, 0x86, 0x91, 0x87,   /* E0 */
+		0x8A, 0x82, 0x88, 0x89, 0x8D, 0xA1, 0x8C, 0x8B,
+		   0, 0xA4, 0x95, 0xA2, 0x93,    0, 0x94, 0xF6,   /* F0 */
+		   0, 0x97, 0xA3, 0x96, 0x81,    0,    0, 0x98
+	};
+
+
+/* Queued request and its completion */
+typedef struct POFO_JOB {
+	struct POFO_JOB *next;
+	POFO_REQUEST request;
+	POFO_COMPLETION completion;
+} POFO_JOB;
+
+
+struct POFO_SESSION {
+	/* Port access */
+#if defined(PPDEV)
+	int fd;                                /* File descriptor for opened parallel port */
+#elif !defined(RASPIWIRING)
+	unsigned short dataPort;
+	unsigned short statusPort;
+#if defined(__DMC__) && !defined(DIRECTIO)
+	HINSTANCE hLib;
+	inpfuncPtr inp32;
+	oupfuncPtr oup32;
+#endif
+#endif
+	int portOpen;
+
+	/* Reporting */
+	POFO_CALLBACKS callbacks;
+	void *user;
+	unsigned long currentId;               /* Request being executed, 0 if synchronous */
+	char errorText[ERROR_TEXT_LEN];
+
+	/* Buffers */
+	unsigned char *payload;
+	unsigned char *controlData;
+	unsigned char *list;
+	unsigned char *frame;                  /* Encoded block for sendBlock() */
+	unsigned char transmitInit[90];
+	unsigned char receiveInit[82];
+
+	/* Port values to output for each byte value, see initWireSymbols() */
+	unsigned char wireSymbols[256][16];
+
+	/* Text conversion, see pofoSetTextMode() */
+	int textMode;
+	unsigned char toPofo[256];             /* Character mapping PC -> Portfolio */
+	unsigned char fromPofo[256];           /* Character mapping Portfolio -> PC */
+	unsigned char *text;                   /* Staging buffer for LF -> CRLF */
+	int textPos, textLen;                  /* Unconverted bytes in the staging buffer */
+	long textLeft;                         /* Unread bytes of the source file */
+	unsigned char textLast;                /* Last source byte before textPos */
+	int textPending;                       /* LF (transmit) or CR (receive) still due */
+
+	/* Link supervision, see pofoConnect() */
+	long timeout;                          /* Max. wait for a clock edge in ms, 0 = forever */
+	int linkLost;                          /* A clock edge did not arrive in time */
+	long syncTime;                         /* Duration of the last synchronization in ms */
+
+	/* Edge detection, see pofoSetSamples() */
+	int samples;                           /* Consistent reads that make a clock edge */
+	unsigned long glitches;                /* Rejected clock edges and outvoted data samples */
+
+	POFO_COUNTERS counters;                /* Link usage, see pofoGetCounters() */
+
+	/* Received file collected for the backup store, see receiveStore() */
+	unsigned char *blob;
+	long blobSize;
+
+	int nReceivedFiles;
+	int nMembers;
+
+	/* Request and completion queues */
+	POFO_JOB *jobs, *lastJob;
+	POFO_JOB *done, *lastDone;
+	unsigned long nextId;
+	int outstanding;                       /* Submitted but not completed */
+#if defined(POFO_THREADS)
+	pthread_mutex_t lock;
+	pthread_cond_t jobAvailable;
+	pthread_cond_t jobDone;
+	pthread_t worker;
+	int workerRunning;
+	int stopping;
+#endif
+};
+
+
+/*
+	Store an error text for pofoErrorText() and return the status
+*/
+static POFO_STATUS fail(POFO_SESSION *s, const POFO_STATUS status, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(s->errorText, sizeof(s->errorText), format, args);
+	va_end(args);
+
+	return status;
+}
+
+
+/*
+	Pass an informational message to the message callback
+*/
+static void report(POFO_SESSION *s, const char *format, ...)
+{
+	char text[2*MAX_FILENAME_LEN + 80];
+	va_list args;
+
+	if (!s->callbacks.message)
+		return;
+
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+
+	s->callbacks.message(s->user, s->currentId, text);
+}
+
+
+#if defined(PPDEV)
+
+/*
+	Open parallel port. Returns 0 on success
+*/
+static int openPort(POFO_SESSION *s, const char * device) {
+	s->fd = open(device ? device : PPDEV, O_RDWR);
+	if (s->fd == -1) {
+		fail(s, POFO_ERR_PORT, "open: %s. Try 'modprobe ppdev' and 'chmod 666 %s' as root!",
+				 strerror(errno), device ? device : PPDEV);
+		return -1;
+	}
+
+	if (ioctl(s->fd, PPCLAIM)) {
+		fail(s, POFO_ERR_PORT, "PPCLAIM: %s", strerror(errno));
+		close(s->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void closePort(POFO_SESSION *s) {
+	ioctl(s->fd, PPRELEASE);
+	close(s->fd);
+}
+
+#elif defined(RASPIWIRING)
+
+static int openPort(POFO_SESSION *s, const char * device) {
+	if (wiringPiSetup () == -1)
+		return -1 ;
+	//configure GPIO pins
+	pinMode(wiringClkIn, INPUT);
+	pinMode(wiringBitIn, INPUT);
+	pinMode(wiringClkOut, OUTPUT);
+	pinMode(wiringBitOut, OUTPUT);
+	return 0;
+}
+
+static void closePort(POFO_SESSION *s) {
+	pinMode(wiringBitOut, INPUT);
+	pinMode(wiringClkOut, INPUT);
+}
+
+#else
+
+/*
+	Get access to I/O port. device holds the port address, NULL for the default.
+	Returns 0 on success
+*/
+static int openPort(POFO_SESSION *s, const char * device) {
+	s->dataPort = device ? strtol(device, NULL, 0) : DATAPORT;
+	s->statusPort = s->dataPort + 1;
+
+#if defined(__DMC__)
+#if defined(DIRECTIO)
+	return 0;
+#else
+	s->hLib = LoadLibrary("inpout32.dll");
+	if (s->hLib == NULL) {
+		fail(s, POFO_ERR_PORT, "INPOUT32.DLL seems to be missing!");
+		return -1;
+	}
+
+	/* get the address of the function */
+	s->inp32 = (inpfuncPtr) GetProcAddress(s->hLib, "Inp32");
+	if (s->inp32 == NULL) {
+		fail(s, POFO_ERR_PORT, "GetProcAddress for Inp32 Failed.");
+		return -1;
+	}
+
+	s->oup32 = (oupfuncPtr) GetProcAddress(s->hLib, "Out32");
+	if (s->oup32 == NULL) {
+		fail(s, POFO_ERR_PORT, "GetProcAddress for Oup32 Failed.");
+		return -1;
+	}
+	return 0;
+#endif
+#else
+	return ioperm(s->dataPort, 3, 255);
+#endif
+}
+
+static void closePort(POFO_SESSION *s) {
+#if defined(__DMC__) && !defined(DIRECTIO)
+	FreeLibrary(s->hLib);
+#endif
+}
+
+#endif
+
+
+/*
+	Read the status register of the parallel port
+*/
+static inline unsigned char readPort(POFO_SESSION *s) {
+	unsigned char byte;
+#if defined(__DMC__)
+
+#if defined(DIRECTIO)
+	byte = inp(s->statusPort);
+#else
+	byte = (s->inp32)(s->statusPort);
+#endif
+
+#else
+
+#if defined(PPDEV)
+	ioctl (s->fd, PPRSTATUS, &byte);
+#elif defined(RASPIWIRING)
+	byte = (digitalRead(wiringClkIn)) << 5 | (digitalRead(wiringBitIn) << 4);
+#else
+	byte = inb(s->statusPort);
+#endif
+
+#endif
+	return byte;
+}
+
+
+/*
+	Output a byte to the data register of the parallel port
+*/
+static inline void writePort(POFO_SESSION *s, const unsigned char byte) {
+#if defined(__DMC__)
+
+#if defined(DIRECTIO)
+	outp(s->dataPort, byte);
+#else
+	(s->oup32)(s->dataPort, byte);
+#endif
+
+#else
+
+#if defined(PPDEV)
+	ioctl (s->fd, PPWDATA, &byte);
+#elif defined(RASPIWIRING)
+	digitalWrite(wiringBitOut, byte & 0x01);
+	digitalWrite(wiringClkOut, (byte >> 1) & 0x01);
+#else
+	outb(byte, s->dataPort);
+#endif
+
+#endif
+}
+
+
+/*
+	Milliseconds from an arbitrary starting point
+*/
+static long nowMs(void)
+{
+#if defined(__DMC__)
+	return clock() * 1000L / CLOCKS_PER_SEC;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000L + t.tv_nsec / 1000000;
+#endif
+}
+
+
+static void sleepMs(const long ms)
+{
+#if defined(__DMC__)
+	usleep(ms * 1000);
+#else
+	struct timespec t;
+	t.tv_sec = ms / 1000;
+	t.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&t, NULL);
+#endif
+}
+
+
+/*
+	Wait until the clock line from the Portfolio has the given level.
+	The level must be read s->samples times in a row; a shorter run is a
+	glitch and is counted but otherwise ignored.
+	The clock is only looked at every SPIN_CHECK port reads, so the usual
+	short waits cost nothing. If the timeout of the session expires, the
+	link is marked as lost and all further waits return immediately until
+	the next pofoConnect().
+*/
+static void waitClock(POFO_SESSION *s, const unsigned char level)
+{
+	unsigned long spins = 0;
+	long deadline = 0;
+	int run = 0;
+
+	while (!s->linkLost && run < s->samples) {
+		if ((readPort(s) & 0x20) == level) {
+			run++;
+			continue;
+		}
+		if (run) {
+			s->glitches++;
+			run = 0;
+		}
+		if (s->timeout && ++spins % SPIN_CHECK == 0) {
+			long now = nowMs();
+			if (!deadline)
+				deadline = now + s->timeout;
+			else if (now - deadline >= 0)
+				s->linkLost = 1;
+		}
+	}
+}
+
+static inline void waitClockHigh(POFO_SESSION *s)
+{
+	waitClock(s, 0x20);
+}
+
+static inline void waitClockLow(POFO_SESSION *s)
+{
+	waitClock(s, 0);
+}
+
+
+/*
+	Sample the data line. With more than one sample per edge, an odd number
+	of reads votes on the bit and every disagreement counts as a glitch.
+*/
+static inline unsigned char getBit(POFO_SESSION *s)
+{
+	int votes = s->samples | 1;
+	int ones = 0;
+	int i;
+
+	if (votes == 1)
+		return( (readPort(s) & 0x10) >> 4 );
+
+	for (i=0; i<votes; i++)
+		ones += (readPort(s) & 0x10) >> 4;
+	if (ones != 0 && ones != votes)
+		s->glitches++;
+	return ones > votes/2;
+}
+
+
+/*
+	Receives one byte serially, MSB first
+	One bit is read on every falling and every rising slope of the clock signal.
+*/
+static unsigned char receiveByte(POFO_SESSION *s)
+{
+	int i;
+	unsigned char byte = 0;
+
+	for (i=0; i<4; i++) {
+		waitClockLow(s);
+		byte = (byte << 1) | getBit(s);
+		writePort(s, 0);                /* Clear clock */
+		waitClockHigh(s);
+		byte = (byte << 1) | getBit(s);
+		writePort(s, 2);                /* Set clock */
+	}
+
+	return byte;
+}
+
+
+/*
+	Precompute the sequence of port values that sendByte() outputs for each
+	possible byte. Every bit is put on the data line (bit 0) before the clock
+	line (bit 1) changes: Four values per bit pair, clock falling for the
+	first bit and rising for the second one.
+*/
+static void initWireSymbols(POFO_SESSION *s)
+{
+	int byte, i;
+
+	for (byte=0; byte<256; byte++) {
+		unsigned char *sym = s->wireSymbols[byte];
+
+		for (i=0; i<4; i++) {
+			unsigned char hi = (byte >> (7-2*i)) & 1;
+			unsigned char lo = (byte >> (6-2*i)) & 1;
+
+			sym[4*i]   = hi | 2;                /* Output data bit */
+			sym[4*i+1] = hi;                    /* Set clock low   */
+			sym[4*i+2] = lo;                    /* Output data bit */
+			sym[4*i+3] = lo | 2;                /* Set clock high  */
+		}
+	}
+}
+
+
+/*
+	Transmits one byte serially, MSB first
+	One bit is transmitted on every falling and every rising slope of the clock signal.
+	Only precomputed port values are written between the clock edges.
+*/
+static void sendByte(POFO_SESSION *s, unsigned char byte)
+{
+	const unsigned char *sym = s->wireSymbols[byte];
+	int i;
+
+#if defined(__DMC__)
+	/* Should be usleep(50), but smaller arguments than 1000 result in no delay */
+	usleep(1000);
+#else
+	struct timespec t;
+	t.tv_sec = 0;
+	t.tv_nsec = 50000;
+	nanosleep(&t, NULL);
+#endif
+
+	for (i=0; i<16; i+=4) {
+		writePort(s, sym[i]);
+		writePort(s, sym[i+1]);
+		waitClockLow(s);
+
+		writePort(s, sym[i+2]);
+		writePort(s, sym[i+3]);
+		waitClockHigh(s);
+	}
+}
+
+
+/*
+	Sum of all bytes of a buffer modulo 256.
+	The loop has no dependencies besides the sum and is vectorized by the compiler.
+*/
+static unsigned char blockSum(const unsigned char *pData, const unsigned int len)
+{
+	unsigned int sum = 0;
+	unsigned int i;
+
+	for (i=0; i<len; i++)
+		sum += pData[i];
+
+	return (unsigned char)sum;
+}
+
+
+/*
+	Assemble the complete frame for a data block ahead of transmission:
+	Acknowledge, length (low, high), payload and checksum.
+	Returns the length of the frame.
+*/
+static unsigned int encodeBlock(const unsigned char *pData, const unsigned int len, unsigned char *pFrame)
+{
+	pFrame[0] = 0x0a5;
+	pFrame[1] = len & 255;
+	pFrame[2] = len >> 8;
+	memcpy(pFrame+3, pData, len);
+	pFrame[len+3] = -(pFrame[1] + pFrame[2] + blockSum(pData, len));
+
+	return len + FRAME_OVERHEAD;
+}
+
+
+static POFO_STATUS lostLink(POFO_SESSION *s)
+{
+	return fail(s, POFO_ERR_TIMEOUT, "Portfolio does not respond!");
+}
+
+
+/*
+	This function transmits a block of data.
+	Call int 61h with AX=3002 (open) and AX=3001 (receive) on the Portfolio
+*/
+static POFO_STATUS sendBlock(POFO_SESSION *s, const unsigned char *pData, const unsigned int len, const VERBOSITY verbosity)
+{
+	unsigned char byte;
+	unsigned int  i, frameLen;
+	unsigned char checksum;
+
+	if (len) {
+		frameLen = encodeBlock(pData, len, s->frame);
+		checksum = s->frame[frameLen-1];
+
+		byte = receiveByte(s);
+
+		if (s->linkLost) {
+			return lostLink(s);
+		}
+		if (byte == 'Z') {
+			if (verbosity >= VERB_FLOWCONTROL) {
+				report(s, "Portfolio ready for receiving.");
+			}
+		}
+		else {
+			return fail(s, POFO_ERR_NOT_READY, "Portfolio not ready!");
+		}
+
+		usleep(50000);
+
+		for (i=0; i<frameLen && !s->linkLost; i++) {
+			sendByte(s, s->frame[i]);
+
+			if (verbosity >= VERB_COUNTER && s->callbacks.progress && i >= 3 && i < len+3)
+				s->callbacks.progress(s->user, s->currentId, i-2, len);
+		}
+
+		byte = receiveByte(s);
+
+		if (s->linkLost) {
+			return lostLink(s);
+		}
+		if (byte == checksum) {
+			if (verbosity >= VERB_FLOWCONTROL) {
+				report(s, "checksum OK");
+			}
+		}
+		else {
+			return fail(s, POFO_ERR_CHECKSUM, "checksum ERR: %d", byte);
+		}
+
+		s->counters.bytes += len;
+		s->counters.frames++;
+	}
+
+	return POFO_OK;
+}
+
+
+/*
+	 This function receives a block of data and stores its length in bytes.
+	 Call int 61h with AX=3002 (open) and AX=3000 (transmit) on the Portfolio.
+*/
+static POFO_STATUS receiveBlock(POFO_SESSION *s, unsigned char *pData, const int maxLen, int *pLen, const VERBOSITY verbosity)
+{
+	unsigned int len, i;
+	unsigned char lenH, lenL;
+	unsigned char checksum = 0;
+	unsigned char byte;
+
+	sendByte(s, 'Z');
+
+	byte = receiveByte(s);
+
+	if (s->linkLost) {
+		return lostLink(s);
+	}
+	if (byte == 0x0a5) {
+		if (verbosity >= VERB_FLOWCONTROL) {
+			report(s, "Acknowledge OK");
+		}
+	}
+	else {
+		return fail(s, POFO_ERR_ACKNOWLEDGE, "Acknowledge ERROR (received %2X instead of A5)", byte);
+	}
+
+	lenL = receiveByte(s);  checksum += lenL;
+	lenH = receiveByte(s);  checksum += lenH;
+	len = (lenH << 8) | lenL;
+
+	if (len > maxLen) {
+		return fail(s, POFO_ERR_BUFFER, "Receive buffer too small (%d instead of %d bytes).", maxLen, len);
+	}
+
+	for (i=0; i<len && !s->linkLost; i++) {
+		unsigned char byte = receiveByte(s);
+		checksum += byte;
+		pData[i] = byte;
+
+		if (verbosity >= VERB_COUNTER && s->callbacks.progress)
+			s->callbacks.progress(s->user, s->currentId, i+1, len);
+	}
+
+	byte = receiveByte(s);
+
+	if (s->linkLost) {
+		return lostLink(s);
+	}
+	if ((unsigned char)(256 - byte) == checksum) {
+		if (verbosity >= VERB_FLOWCONTROL) {
+			report(s, "checksum OK");
+		}
+	}
+	else {
+		return fail(s, POFO_ERR_CHECKSUM, "checksum ERR %d %d", (unsigned char)(256 - byte), checksum);
+	}
+
+	usleep(100);
+	sendByte(s, (unsigned char)(256 - checksum));
+
+	/* The length of control replies depends on the Portfolio and cannot be
+	   planned, so only payload (received with progress) counts as bytes */
+	if (verbosity >= VERB_COUNTER)
+		s->counters.bytes += len;
+	s->counters.frames++;
+
+	if (pLen)
+		*pLen = len;
+	return POFO_OK;
+}
+
+
+/*
+	Apply a character mapping to a buffer
+*/
+static void mapCharacters(unsigned char *pData, const int len, const unsigned char *map)
+{
+	int i;
+
+	for (i=0; i<len; i++)
+		pData[i] = map[pData[i]];
+}
+
+
+/*
+	Determine the length of a file after LF -> CRLF conversion.
+	The file is read from the current position and rewound afterwards.
+	Returns -1 on read or seek errors.
+*/
+static long convertedLength(POFO_SESSION *s, FILE * file, const long len)
+{
+	long start = ftell(file);
+	long left = len;
+	long count = len;
+	unsigned char last = 0;
+
+	while (left > 0) {
+		int n = left < TEXT_BUFSIZE ? left : TEXT_BUFSIZE;
+		const unsigned char *pos = s->text;
+		const unsigned char *end = s->text + n;
+		const unsigned char *lf;
+
+		if (fread(s->text, 1, n, file) != n)
+			return -1;
+
+		/* memchr() scans a word or vector at a time, which pays off for long lines */
+		while ((lf = memchr(pos, '\n', end - pos)) != NULL) {
+			if ((lf > s->text ? lf[-1] : last) != '\r')
+				count++;
+			pos = lf + 1;
+		}
+		last = end[-1];
+		left -= n;
+	}
+
+	if (start == -1 || fseek(file, start, SEEK_SET) != 0)
+		return -1;
+	return count;
+}
+
+
+/*
+	Fill the payload buffer with len bytes of the source file, converted
+	according to the text mode. Returns 0 on success.
+*/
+static int readPayload(POFO_SESSION *s, FILE * file, const int len)
+{
+	unsigned char *out = s->payload;
+	int got = 0;
+
+	if (!(s->textMode & POFO_TEXT_LINES)) {
+		if (fread(s->payload, sizeof(char), len, file) != len)
+			return -1;
+		got = len;
+	}
+	else {
+		/* A CRLF was split at the previous block boundary */
+		if (s->textPending && got < len) {
+			out[got++] = '\n';
+			s->textPending = 0;
+		}
+
+		while (got < len) {
+			const unsigned char *src;
+			const unsigned char *lf;
+			int avail, run;
+
+			if (s->textPos == s->textLen) {
+				int n = s->textLeft < TEXT_BUFSIZE ? s->textLeft : TEXT_BUFSIZE;
+				if (n == 0 || fread(s->text, 1, n, file) != n)
+					return -1;
+				s->textLeft -= n;
+				s->textPos = 0;
+				s->textLen = n;
+			}
+
+			/* Copy everything up to the next line feed in one go */
+			src = s->text + s->textPos;
+			avail = s->textLen - s->textPos;
+			if (avail > len - got)
+				avail = len - got;
+			lf = memchr(src, '\n', avail);
+			run = lf ? lf - src : avail;
+
+			memcpy(out + got, src, run);
+			got += run;
+			s->textPos += run;
+			if (run)
+				s->textLast = src[run-1];
+			if (!lf)
+				continue;
+
+			/* Insert CR before a bare LF */
+			s->textPos++;
+			if (s->textLast != '\r') {
+				out[got++] = '\r';
+				if (got == len) {
+					s->textPending = 1;
+					s->textLast = '\n';
+					break;
+				}
+			}
+			out[got++] = '\n';
+			s->textLast = '\n';
+		}
+	}
+
+	if (s->textMode & POFO_TEXT_CP437)
+		mapCharacters(s->payload, got, s->toPofo);
+	return 0;
+}
+
+
+/*
+	Convert a received block in place according to the text mode and
+	return its new length. A CR at the end of the block is held back
+	until the next block shows whether it starts a CRLF.
+*/
+static int convertReceived(POFO_SESSION *s, unsigned char *pData, const int len)
+{
+	unsigned char *out = pData;
+	unsigned char *src = pData;
+	unsigned char *end = pData + len;
+
+	if (s->textMode & POFO_TEXT_LINES) {
+		while (src < end) {
+			unsigned char *cr = memchr(src, '\r', end - src);
+			int run = cr ? cr - src : end - src;
+
+			memmove(out, src, run);
+			out += run;
+			src += run;
+			if (!cr)
+				break;
+
+			src++;
+			if (src == end)
+				s->textPending = 1;
+			else if (*src != '\n')
+				*out++ = '\r';
+		}
+	}
+	else {
+		out = end;
+	}
+
+	if (s->textMode & POFO_TEXT_CP437)
+		mapCharacters(pData, out - pData, s->fromPofo);
+	return out - pData;
+}
+
+
+/*
+	SHA-256 (FIPS 180-4) for the content addresses of the backup store.
+	unsigned long has at least 32 bits; results are masked to 32 bits.
+*/
+typedef struct {
+	unsigned long state[8];
+	unsigned long length;                  /* Bytes hashed so far */
+	unsigned char block[64];
+	int fill;
+} SHA256;
+
+#define SHA_MASK     0xFFFFFFFFUL
+#define SHA_ROTR(x,n) ((((x) >> (n)) | ((x) << (32-(n)))) & SHA_MASK)
+
+static const unsigned long sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+static void sha256Init(SHA256 *c)
+{
+	static const unsigned long init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(c->state, init, sizeof(init));
+	c->length = 0;
+	c->fill = 0;
+}
+
+
+static void sha256Block(SHA256 *c, const unsigned char *p)
+{
+	unsigned long w[64];
+	unsigned long a, b, d, e, f, g, h, t1, t2;
+	unsigned long cc;
+	int i;
+
+	for (i=0; i<16; i++) {
+		w[i] = ((unsigned long)p[4*i] << 24) | ((unsigned long)p[4*i+1] << 16) |
+			((unsigned long)p[4*i+2] << 8) | p[4*i+3];
+	}
+	for (i=16; i<64; i++) {
+		unsigned long s0 = SHA_ROTR(w[i-15], 7) ^ SHA_ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+		unsigned long s1 = SHA_ROTR(w[i-2], 17) ^ SHA_ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = (w[i-16] + s0 + w[i-7] + s1) & SHA_MASK;
+	}
+
+	a = c->state[0];  b = c->state[1];  cc = c->state[2]; d = c->state[3];
+	e = c->state[4];  f = c->state[5];  g = c->state[6];  h = c->state[7];
+
+	for (i=0; i<64; i++) {
+		t1 = h + (SHA_ROTR(e, 6) ^ SHA_ROTR(e, 11) ^ SHA_ROTR(e, 25)) +
+			((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+		t2 = (SHA_ROTR(a, 2) ^ SHA_ROTR(a, 13) ^ SHA_ROTR(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+		h = g;
+		g = f;
+		f = e;
+		e = (d + t1) & SHA_MASK;
+		d = cc;
+		cc = b;
+		b = a;
+		a = (t1 + t2) & SHA_MASK;
+	}
+
+	c->state[0] = (c->state[0] + a) & SHA_MASK;
+	c->state[1] = (c->state[1] + b) & SHA_MASK;
+	c->state[2] = (c->state[2] + cc) & SHA_MASK;
+	c->state[3] = (c->state[3] + d) & SHA_MASK;
+	c->state[4] = (c->state[4] + e) & SHA_MASK;
+	c->state[5] = (c->state[5] + f) & SHA_MASK;
+	c->state[6] = (c->state[6] + g) & SHA_MASK;
+	c->state[7] = (c->state[7] + h) & SHA_MASK;
+}
+
+
+static void sha256Update(SHA256 *c, const unsigned char *p, long len)
+{
+	c->length += len;
+
+	while (len > 0) {
+		if (c->fill == 0 && len >= 64) {
+			sha256Block(c, p);
+			p += 64;
+			len -= 64;
+		}
+		else {
+			int n = 64 - c->fill;
+			if (n > len)
+				n = len;
+			memcpy(c->block + c->fill, p, n);
+			c->fill += n;
+			p += n;
+			len -= n;
+			if (c->fill == 64) {
+				sha256Block(c, c->block);
+				c->fill = 0;
+			}
+		}
+	}
+}
+
+
+static void sha256Final(SHA256 *c, unsigned char hash[HASH_LEN])
+{
+	unsigned long bits = c->length;
+	int i;
+
+	c->block[c->fill++] = 0x80;
+	if (c->fill > 56) {
+		memset(c->block + c->fill, 0, 64 - c->fill);
+		sha256Block(c, c->block);
+		c->fill = 0;
+	}
+	memset(c->block + c->fill, 0, 56 - c->fill);
+	/* Bit length, big endian; files are far smaller than 2^32 bytes */
+	c->block[56] = c->block[57] = c->block[58] = 0;
+	c->block[59] = (bits >> 29) & 255;
+	c->block[60] = (bits >> 21) & 255;
+	c->block[61] = (bits >> 13) & 255;
+	c->block[62] = (bits >> 5) & 255;
+	c->block[63] = (bits << 3) & 255;
+	sha256Block(c, c->block);
+
+	for (i=0; i<8; i++) {
+		hash[4*i]   = (c->state[i] >> 24) & 255;
+		hash[4*i+1] = (c->state[i] >> 16) & 255;
+		hash[4*i+2] = (c->state[i] >> 8) & 255;
+		hash[4*i+3] = c->state[i] & 255;
+	}
+}
+
+
+static int makeDir(const char *path)
+{
+#if defined(__DMC__)
+	return mkdir(path);
+#else
+	return mkdir(path, 0777);
+#endif
+}
+
+
+/*
+	Put a received file into the backup store and the snapshot.
+	The content is written to STORE/xx/yyyy... (SHA-256 in hex) only if
+	the store does not hold it yet and made read-only. The snapshot gets a
+	hard link to the blob, or a copy where links are not supported, and a
+	line in its .index file.
+*/
+static POFO_STATUS storeBlob(POFO_SESSION *s, const unsigned char hash[HASH_LEN], const long len,
+														 const char *store, const char *snapshot, const char *name, const char *target)
+{
+	char hex[2*HASH_LEN+1];
+	char blobPath[FILENAME_MAX];
+	char tmpPath[FILENAME_MAX];
+	struct stat st;
+	FILE *file;
+	int isNew = 0;
+	int i;
+
+	for (i=0; i<HASH_LEN; i++)
+		sprintf(hex + 2*i, "%02x", hash[i]);
+
+	snprintf(blobPath, sizeof(blobPath), "%s/%.2s", store, hex);
+	makeDir(blobPath);
+	snprintf(blobPath, sizeof(blobPath), "%s/%.2s/%s", store, hex, hex+2);
+
+	if (stat(blobPath, &st) != 0) {
+		/* New content: write it under a temporary name first, so that an
+		   interrupted backup never leaves a truncated blob behind */
+		snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", blobPath);
+		file = fopen(tmpPath, "wb");
+		if (file == NULL)
+			return fail(s, POFO_ERR_CREATE, "Cannot create file: %s", tmpPath);
+		if (fwrite(s->blob, 1, len, file) != len) {
+			fclose(file);
+			remove(tmpPath);
+			return fail(s, POFO_ERR_IO, "Cannot write to store: %s", tmpPath);
+		}
+		if (fclose(file) != 0) {
+			remove(tmpPath);
+			return fail(s, POFO_ERR_IO, "Cannot write to store: %s", tmpPath);
+		}
+		if (rename(tmpPath, blobPath) != 0) {
+			remove(tmpPath);
+			return fail(s, POFO_ERR_IO, "Cannot write to store: %s", blobPath);
+		}
+#if !defined(__DMC__)
+		/* Blobs are shared by all snapshots and must not be modified */
+		chmod(blobPath, 0444);
+#endif
+		isNew = 1;
+	}
+
+	remove(target);
+#if !defined(__DMC__)
+	if (link(blobPath, target) != 0)
+#endif
+	{
+		/* No hard links (other file system, DOS): the snapshot gets a copy */
+		file = fopen(target, "wb");
+		if (file == NULL)
+			return fail(s, POFO_ERR_CREATE, "Cannot create file: %s", target);
+		if (fwrite(s->blob, 1, len, file) != len) {
+			fclose(file);
+			remove(target);
+			return fail(s, POFO_ERR_IO, "Cannot write to file: %s", target);
+		}
+		if (fclose(file) != 0) {
+			remove(target);
+			return fail(s, POFO_ERR_IO, "Cannot write to file: %s", target);
+		}
+	}
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s/.index", snapshot);
+	file = fopen(tmpPath, "a");
+	if (file == NULL)
+		return fail(s, POFO_ERR_CREATE, "Cannot create file: %s", tmpPath);
+	fprintf(file, "%s %ld %s\n", hex, len, name);
+	fclose(file);
+
+	report(s, "%s %s", hex, isNew ? "stored" : "already in store");
+	return POFO_OK;
+}
+
+
+/*
+	Write a ustar header for a member of the given size to the archive.
+	Returns 0 on success.
+*/
+static int writeTarHeader(FILE * file, const char * name, const long size)
+{
+	unsigned char header[TAR_BLOCKSIZE];
+	unsigned int checksum = 0;
+	int i;
+
+	memset(header, 0, sizeof(header));
+	strncpy((char*)header, name, 99);                          /* name     */
+	sprintf((char*)header+100, "%07o", 0644);                  /* mode     */
+	sprintf((char*)header+108, "%07o", 0);                     /* uid      */
+	sprintf((char*)header+116, "%07o", 0);                     /* gid      */
+	sprintf((char*)header+124, "%011lo", (unsigned long)size); /* size     */
+	sprintf((char*)header+136, "%011lo", (unsigned long)time(NULL));
+	memset(header+148, ' ', 8);                                /* chksum   */
+	header[156] = '0';                                         /* typeflag */
+	memcpy(header+257, "ustar", 6);                            /* magic    */
+	memcpy(header+263, "00", 2);                               /* version  */
+
+	for (i=0; i<TAR_BLOCKSIZE; i++)
+		checksum += header[i];
+	sprintf((char*)header+148, "%06o", checksum);
+
+	return fwrite(header, 1, TAR_BLOCKSIZE, file) == TAR_BLOCKSIZE ? 0 : -1;
+}
+
+
+/*
+	Pad the current archive member to a full tar block.
+*/
+static void padTarMember(FILE * file, const long size)
+{
+	static const unsigned char zeros[TAR_BLOCKSIZE];
+	int pad = (TAR_BLOCKSIZE - size % TAR_BLOCKSIZE) % TAR_BLOCKSIZE;
+
+	fwrite(zeros, 1, pad, file);
+}
+
+
+/*
+	Terminate a tar archive with two zero blocks and close it.
+*/
+void closeTarArchive(FILE * file)
+{
+	static const unsigned char zeros[2*TAR_BLOCKSIZE];
+
+	fwrite(zeros, 1, sizeof(zeros), file);
+	fclose(file);
+}
+
+
+/*
+	Read the next member header from a tar archive.
+	The member name is stored in name (GNU long names are resolved),
+	the size of its data in *size. The file is left positioned at the data.
+	Returns the type flag ('0' for regular files) or 0 at the end of the archive.
+*/
+static int readTarHeader(FILE * file, char * name, long * size)
+{
+	unsigned char header[TAR_BLOCKSIZE];
+	int haveLongName = 0;
+
+	for (;;) {
+		char type;
+
+		if (fread(header, 1, TAR_BLOCKSIZE, file) != TAR_BLOCKSIZE || header[0] == 0)
+			return 0;
+
+		*size = strtol((char*)header+124, NULL, 8);
+		type = header[156] ? header[156] : '0';
+
+		if (type == 'L') {
+			/* GNU long name: the data of this member is the name of the next one */
+			long len = *size < TAR_NAME_LEN-1 ? *size : TAR_NAME_LEN-1;
+			if (fread(name, 1, len, file) != len)
+				return 0;
+			name[len] = 0;
+			fseek(file, ((*size + TAR_BLOCKSIZE-1) & ~(TAR_BLOCKSIZE-1)) - len, SEEK_CUR);
+			haveLongName = 1;
+			continue;
+		}
+
+		if (!haveLongName) {
+			if (header[345] && memcmp(header+257, "ustar", 5) == 0) {
+				/* ustar prefix field holds the leading path components */
+				snprintf(name, TAR_NAME_LEN, "%.155s/%.100s", header+345, header);
+			}
+			else {
+				snprintf(name, TAR_NAME_LEN, "%.100s", header);
+			}
+		}
+		return type;
+	}
+}
+
+
+/*
+	Transmit len bytes read from an open file to the Portfolio (/t)
+*/
+POFO_STATUS transmitStream(POFO_SESSION *s, FILE * file, int len, const char * dest, int force) {
+	POFO_STATUS status;
+	int blocksize;
+
+	if (s->textMode & POFO_TEXT_LINES) {
+		/* The Portfolio needs the final length up front */
+		s->textLeft = len;
+		s->textPos = s->textLen = 0;
+		s->textLast = 0;
+		s->textPending = 0;
+		len = convertedLength(s, file, len);
+		if (len == -1)
+			return fail(s, POFO_ERR_IO, "Read error!");
+	}
+
+	s->transmitInit[7] = len & 255;
+	s->transmitInit[8] = (len >> 8) & 255;
+	s->transmitInit[9] = (len >> 16) & 255;
+
+	strncpy((char*)s->transmitInit+11, dest, MAX_FILENAME_LEN);
+
+	if ((status = sendBlock(s, s->transmitInit, sizeof(s->transmitInit), VERB_ERRORS)) != POFO_OK ||
+			(status = receiveBlock(s, s->controlData, CONTROL_BUFSIZE, NULL, VERB_ERRORS)) != POFO_OK)
+		return status;
+
+	if (s->controlData[0] == 0x10) {
+		return fail(s, POFO_ERR_INVALID_DEST, "Invalid destination file!");
+	}
+
+	if (s->controlData[0] == 0x20) {
+		if (force) {
+			report(s, "File exists on Portfolio and is being overwritten.");
+			status = sendBlock(s, transmitOverwrite, sizeof(transmitOverwrite), VERB_ERRORS);
+			if (status != POFO_OK)
+				return status;
+		}
+		else {
+			status = sendBlock(s, transmitCancel, sizeof(transmitCancel), VERB_ERRORS);
+			if (status != POFO_OK)
+				return status;
+			return fail(s, POFO_ERR_EXISTS, "File exists on Portfolio: %s", dest);
+		}
+	}
+
+	blocksize = s->controlData[1] + (s->controlData[2] << 8);
+	if (blocksize > PAYLOAD_BUFSIZE) {
+		return fail(s, POFO_ERR_BUFFER, "Payload buffer too small!");
+	}
+
+	if (len > blocksize) {
+		report(s, "Transmission consists of %d blocks of payload.", (len+blocksize-1)/blocksize);
+	}
+
+	while (len > blocksize) {
+		if (readPayload(s, file, blocksize) != 0)
+			return fail(s, POFO_ERR_IO, "Read error!");
+		if ((status = sendBlock(s, s->payload, blocksize, VERB_COUNTER)) != POFO_OK)
+			return status;
+		len -= blocksize;
+	}
+
+	if (readPayload(s, file, len) != 0)
+		return fail(s, POFO_ERR_IO, "Read error!");
+	if (len && (status = sendBlock(s, s->payload, len, VERB_COUNTER)) != POFO_OK)
+		return status;
+	if ((status = receiveBlock(s, s->controlData, CONTROL_BUFSIZE, NULL, VERB_ERRORS)) != POFO_OK)
+		return status;
+
+	if (s->controlData[0] != 0x20) {
+		return fail(s, POFO_ERR_TRANSMISSION,
+								"Transmission failed!\nPossilby disk full on Portfolio or directory does not exist.");
+	}
+
+	s->counters.files++;
+	return POFO_OK;
+}
+
+
+/*
+	Read source file on PC and transmit it to the Portfolio (/t)
+*/
+POFO_STATUS transmitFile(POFO_SESSION *s, const char * source, const char * dest, int force) {
+	POFO_STATUS status;
+	FILE * file = fopen(source, "rb");
+	int val, len;
+
+	if (file == NULL) {
+		return fail(s, POFO_ERR_FILE_NOT_FOUND, "File not found: %s", source);
+	}
+
+	/*
+		Dateigroesse ermitteln
+	*/
+	val = fseek(file, 0, SEEK_END);
+	if (val != 0) {
+		fclose(file);
+		return fail(s, POFO_ERR_IO, "Seek error!");
+	}
+	len = ftell(file);
+	if (len == -1 || len > 32*1024*1024) {
+		/* Directories and huge files (>32 MB) are skipped */
+		fclose(file);
+		return fail(s, POFO_ERR_SKIPPED, "Skipping %s.", source);
+	}
+	val = fseek(file, 0, SEEK_SET);
+	if (val != 0) {
+		fclose(file);
+		return fail(s, POFO_ERR_IO, "Seek error!");
+	}
+
+	status = transmitStream(s, file, len, dest, force);
+
+	fclose(file);
+	return status;
+}
+
+
+/*
+	Transmit each regular file contained in a tar archive to the Portfolio (/t /a)
+	Member names are mapped to DOS names below the destination directory.
+	Members that exist on the Portfolio or are too large are skipped.
+*/
+POFO_STATUS transmitArchive(POFO_SESSION *s, const char * source, char * dest, int force) {
+	POFO_STATUS status = POFO_OK;
+	FILE * file = fopen(source, "rb");
+	char name[TAR_NAME_LEN];
+	char pofoName[MAX_FILENAME_LEN+1];
+	long size;
+	int type;
+
+	if (file == NULL) {
+		return fail(s, POFO_ERR_FILE_NOT_FOUND, "File not found: %s", source);
+	}
+
+	while ((type = readTarHeader(file, name, &size)) != 0) {
+		long next = ftell(file) + ((size + TAR_BLOCKSIZE-1) & ~(TAR_BLOCKSIZE-1));
+
+		if (type == '0' || type == '7') {
+			if (size > 32*1024*1024) {
+				report(s, "Skipping %s.", name);
+			}
+			else {
+				/* An archive always holds a list of files, so dest is a directory */
+				composePofoName(name, dest, pofoName, 2);
+				report(s, "Transmitting member %d: %s -> %s", ++s->nMembers, name, pofoName);
+				status = transmitStream(s, file, size, pofoName, force);
+				if (status == POFO_ERR_EXISTS || status == POFO_ERR_INVALID_DEST) {
+					report(s, "%s", s->errorText);
+					status = POFO_OK;
+				}
+				else if (status != POFO_OK) {
+					break;
+				}
+			}
+		}
+
+		if (fseek(file, next, SEEK_SET) != 0) {
+			status = fail(s, POFO_ERR_IO, "Seek error!");
+			break;
+		}
+	}
+
+	fclose(file);
+	return status;
+}
+
+
+/*
+	Receive source file(s) from the Portfolio and save them on the PC (/r).
+	If stream is given, the files are appended to it instead, as tar members
+	if tar is set. If store is given, dest is a snapshot directory that
+	refers to the files in the backup store.
+*/
+static POFO_STATUS receiveFiles(POFO_SESSION *s, const char * source, const char * dest, int force,
+																FILE * stream, int tar, const char * store) {
+	POFO_STATUS status;
+	FILE * file;
+	int i, num, len, total;
+	int destIsDir = 0;
+	int blocksize = 0x7000;   /* TODO: Check if this is always the same */
+	char path[FILENAME_MAX];
+	const char *target = dest;
+	struct stat st;
+	char *namebase;
+	char *basename;
+	char *pos;
+	SHA256 hash;
+
+	/* The snapshot directory is created on the first backup */
+	if (store && stat(dest, &st) != 0 && makeDir(dest) != 0) {
+		return fail(s, POFO_ERR_CREATE, "Cannot create directory: %s", dest);
+	}
+
+	/* Check if the destination parameter specifies a directory */
+	if (!stream && stat(dest, &st) == 0 && S_ISDIR(st.st_mode)) {
+		destIsDir = 1;
+	}
+	else if (store) {
+		return fail(s, POFO_ERR_CREATE, "Not a directory: %s", dest);
+	}
+
+	/* Get list of matching files */
+	s->receiveInit[0] = 6;
+	strncpy((char*)s->receiveInit+3, source, MAX_FILENAME_LEN);
+	if ((status = sendBlock(s, s->receiveInit, sizeof(s->receiveInit), VERB_ERRORS)) != POFO_OK ||
+			(status = receiveBlock(s, s->list, LIST_BUFSIZE, NULL, VERB_ERRORS)) != POFO_OK)
+		return status;
+
+	num = s->list[0] + (s->list[1] << 8);
+
+	if (num == 0) {
+		return fail(s, POFO_ERR_NOT_FOUND, "File not found on Portfolio: %s", source);
+	}
+
+	/* Set up pointer to behind the path where basename shall be appended */
+	namebase = (char*)s->receiveInit+3;
+	pos = strrchr(namebase, ':');
+	if (pos) {
+		namebase = pos + 1;
+	}
+	pos = strrchr(namebase, '\\');
+	if (pos) {
+		namebase = pos + 1;
+	}
+
+	basename = (char*)s->list + 2;
+
+	/* Transfer each file from the list */
+	for (i=1; i<=num; i++) {
+
+		if (s->callbacks.file)
+			s->callbacks.file(s->user, s->currentId, s->nReceivedFiles + i, num, basename);
+
+		if (destIsDir) {
+			snprintf(path, sizeof(path), "%s/%s", dest, basename);
+			target = path;
+		}
+
+		if (stream) {
+			/* Data is appended to the destination stream */
+			file = stream;
+		}
+		else {
+			/* Check if destination file exists */
+			file = fopen(target, "rb");
+			if (file != NULL) {
+				fclose(file);
+				if (!force) {
+					s->nReceivedFiles += i-1;
+					return fail(s, POFO_ERR_EXISTS, "File exists: %s%s", target,
+											i<num ? "\nRemaining files are not copied!" : "");
+				}
+			}
+
+			/* Open destination file; the store keeps the data in memory until it is hashed */
+			file = store ? NULL : fopen(target, "wb");
+			if (file == NULL && !store) {
+				s->nReceivedFiles += i-1;
+				return fail(s, POFO_ERR_CREATE, "Cannot create file: %s", target);
+			}
+		}
+
+		/* Request Portfolio to send file */
+		s->receiveInit[0] = 2;
+		strncpy(namebase, basename, MAX_FILENAME_LEN);
+		status = sendBlock(s, s->receiveInit, sizeof(s->receiveInit), VERB_ERRORS);
+
+		/* Get file length information */
+		if (status == POFO_OK)
+			status = receiveBlock(s, s->controlData, CONTROL_BUFSIZE, NULL, VERB_ERRORS);
+
+		if (status == POFO_OK && s->controlData[0] != 0x20) {
+			status = fail(s, POFO_ERR_PROTOCOL, "Unknown protocol error!");
+		}
+
+		if (status == POFO_OK) {
+			total = s->controlData[7] + ((int)s->controlData[8] << 8) + ((int)s->controlData[9] << 16);
+
+			if (total > blocksize) {
+				report(s, "Transmission consists of %d blocks of payload.", (total+blocksize-1)/blocksize);
+			}
+
+			if (tar && writeTarHeader(stream, basename, total) != 0) {
+				status = fail(s, POFO_ERR_IO, "Cannot write to archive!");
+			}
+
+			if (store && total > s->blobSize) {
+				unsigned char *blob = realloc(s->blob, total);
+				if (blob == NULL) {
+					status = fail(s, POFO_ERR_MEMORY, "Out of memory!");
+				}
+				else {
+					s->blob = blob;
+					s->blobSize = total;
+				}
+			}
+			sha256Init(&hash);
+
+			/* Receive and save actual payload */
+			len = total;
+			s->textPending = 0;
+			while (status == POFO_OK && total > 0) {
+				int n;
+				status = receiveBlock(s, s->payload, PAYLOAD_BUFSIZE, &n, VERB_COUNTER);
+				if (status == POFO_OK && store) {
+					/* Hash each block as it arrives */
+					if (n > total) {
+						status = fail(s, POFO_ERR_PROTOCOL, "Unknown protocol error!");
+						break;
+					}
+					sha256Update(&hash, s->payload, n);
+					memcpy(s->blob + len - total, s->payload, n);
+					total -= n;
+				}
+				else if (status == POFO_OK) {
+					total -= n;
+					if (s->textMode && !tar) {
+						/* Output a CR held back from the previous block unless it starts a CRLF */
+						if (s->textPending && (n == 0 || s->payload[0] != '\n'))
+							fputc(s->fromPofo['\r'], file);
+						s->textPending = 0;
+						n = convertReceived(s, s->payload, n);
+					}
+					fwrite(s->payload, 1, n, file);
+				}
+			}
+			if (status == POFO_OK && s->textPending && !tar && !store)
+				fputc(s->fromPofo['\r'], file);
+
+			/* Close connection */
+			if (status == POFO_OK)
+				status = sendBlock(s, receiveFinish, sizeof(receiveFinish), VERB_ERRORS);
+			if (status == POFO_OK && tar)
+				padTarMember(stream, len);
+			if (status == POFO_OK && store) {
+				unsigned char digest[HASH_LEN];
+				sha256Final(&hash, digest);
+				status = storeBlob(s, digest, len, store, dest, basename, target);
+			}
+		}
+
+		/* Close destination file */
+		if (file && !stream)
+			fclose(file);
+
+		if (status != POFO_OK) {
+			s->nReceivedFiles += i-1;
+			return status;
+		}
+
+		s->counters.files++;
+		basename += strlen(basename) + 1;
+	}
+
+	s->nReceivedFiles += num;
+	return POFO_OK;
+}
+
+
+POFO_STATUS receiveFile(POFO_SESSION *s, const char * source, const char * dest, int force) {
+	return receiveFiles(s, source, dest, force, NULL, 0, NULL);
+}
+
+
+POFO_STATUS receiveArchive(POFO_SESSION *s, const char * source, FILE * archive) {
+	return receiveFiles(s, source, NULL, 1, archive, 1, NULL);
+}
+
+
+POFO_STATUS receiveStream(POFO_SESSION *s, const char * source, FILE * stream) {
+	return receiveFiles(s, source, NULL, 1, stream, 0, NULL);
+}
+
+
+/*
+	Back up files into a deduplicating store (/r /k). Each file is hashed
+	while it is received and its content is written to the store directory
+	only if it is not there yet. The snapshot directory, which must be on
+	the same file system as the store to use hard links, refers to the
+	blobs under the Portfolio file names, so it can be restored with
+	transmitFile() like any other directory. The text mode is not applied,
+	so the store always holds the exact content of the Portfolio files.
+*/
+POFO_STATUS receiveStore(POFO_SESSION *s, const char * source, const char * store, const char * snapshot,
+												 int force) {
+	struct stat st;
+
+	if (stat(store, &st) != 0 && makeDir(store) != 0) {
+		return fail(s, POFO_ERR_CREATE, "Cannot create directory: %s", store);
+	}
+	return receiveFiles(s, source, snapshot, force, NULL, 0, store);
+}
+
+
+/*
+	Get directory listing from the Portfolio (/l)
+	*names is set to a buffer holding *count NUL terminated names which
+	must be released with free().
+*/
+POFO_STATUS listFiles(POFO_SESSION *s, const char * pattern, char **names, int *count) {
+	POFO_STATUS status;
+	int i, num, len;
+	char *name;
+
+	*names = NULL;
+	*count = 0;
+
+	/* receiveFile() may have changed the function */
+	s->receiveInit[0] = 6;
+	strncpy((char*)s->receiveInit+3, pattern, MAX_FILENAME_LEN);
+	if ((status = sendBlock(s, s->receiveInit, sizeof(s->receiveInit), VERB_ERRORS)) != POFO_OK ||
+			(status = receiveBlock(s, s->payload, PAYLOAD_BUFSIZE, &len, VERB_ERRORS)) != POFO_OK)
+		return status;
+
+	num = s->payload[0] + (s->payload[1] << 8);
+
+	name = (char*)s->payload + 2;
+	for (i=0; i<num; i++) {
+		name += strlen(name) + 1;
+	}
+
+	*names = malloc(name - (char*)s->payload - 2 + 1);
+	if (*names == NULL) {
+		return fail(s, POFO_ERR_MEMORY, "Out of memory!");
+	}
+	memcpy(*names, s->payload + 2, name - (char*)s->payload - 2);
+	*count = num;
+
+	return POFO_OK;
+}
+
+
+/*
+	Assemble full destination path and name if only the destination directory is given.
+	The current source file name is appended to the destination directory and modified
+	to fulfill the (most important) DOS file naming restrictions. source and dest are
+	not modified; the name is adapted in pofoName.
+*/
+void composePofoName(const char *source, const char *dest, char *pofoName, int sourcecount)
+{
+	const char *ext;
+	char *pos;
+	char  lastChar;
+
+	strncpy(pofoName, dest, MAX_FILENAME_LEN);
+	pofoName[MAX_FILENAME_LEN] = 0;
+
+	/* Exchange Slash by Backslash (Unix path -> DOS path) */
+	while ((pos = strchr(pofoName, '/'))) {
+		*pos = '\\';
+	}
+
+	lastChar = pofoName[strlen(pofoName)-1];
+
+	if (sourcecount > 1 || lastChar == '\\' || lastChar ==':') {
+		/* "dest" is a directory. */
+		int len;
+
+		/* Append Backslash: */
+		if (lastChar != '\\')
+			strncat(pofoName, "\\", MAX_FILENAME_LEN-strlen(pofoName));
+
+		/* Skip path part in source: */
+		ext = strrchr(source, '/');
+		if (!ext)
+			ext = strrchr(source, '\\');
+		if (ext)
+			source = ext+1;
+
+		ext = strrchr(source, '.');
+		if (ext) {
+			/* Append file name without extension: */
+			pos = pofoName + strlen(pofoName);
+			len = ext-source;
+			if (len > 8)
+				len = 8;
+			if (len > MAX_FILENAME_LEN-strlen(pofoName))
+				len = MAX_FILENAME_LEN-strlen(pofoName);
+			strncat(pofoName, source, len);
+
+			/* Replace dots before extension by underscores */
+			while ((pos = strchr(pos, '.'))) {
+				*pos = '_';
+			}
+
+			/* Append file name extension */
+			len = 4;
+			if (len > MAX_FILENAME_LEN-strlen(pofoName))
+				len = MAX_FILENAME_LEN-strlen(pofoName);
+			strncat(pofoName, ext, len);
+		}
+		else {
+			/* There is no extension */
+			len = 8;
+			if (len > MAX_FILENAME_LEN-strlen(pofoName))
+				len = MAX_FILENAME_LEN-strlen(pofoName);
+			strncat(pofoName, source, len);
+		}
+	}
+}
+
+
+/*
+	Allocate a session. The port is opened with pofoOpen().
+	Returns NULL if out of memory.
+*/
+POFO_SESSION * pofoCreate(void)
+{
+	POFO_SESSION *s = calloc(1, sizeof(POFO_SESSION));
+
+	if (s == NULL)
+		return NULL;
+
+	s->payload = malloc(PAYLOAD_BUFSIZE);
+	s->controlData = malloc(CONTROL_BUFSIZE);
+	s->list = malloc(LIST_BUFSIZE);
+	s->frame = malloc(PAYLOAD_BUFSIZE + FRAME_OVERHEAD);
+	s->text = malloc(TEXT_BUFSIZE);
+
+	if (s->payload == NULL || s->controlData == NULL || s->list == NULL || s->frame == NULL ||
+			s->text == NULL) {
+		free(s->payload);
+		free(s->controlData);
+		free(s->list);
+		free(s->frame);
+		free(s->text);
+		free(s);
+		return NULL;
+	}
+
+	memcpy(s->transmitInit, transmitInitTemplate, sizeof(transmitInitTemplate));
+	memcpy(s->receiveInit, receiveInitTemplate, sizeof(receiveInitTemplate));
+	initWireSymbols(s);
+	pofoSetTextMode(s, 0);
+	s->samples = POFO_SAMPLES;
+	s->nextId = 1;
+
+#if defined(POFO_THREADS)
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->jobAvailable, NULL);
+	pthread_cond_init(&s->jobDone, NULL);
+#endif
+
+	return s;
+}
+
+
+void pofoSetCallbacks(POFO_SESSION *s, const POFO_CALLBACKS *callbacks, void *user)
+{
+	s->callbacks = *callbacks;
+	s->user = user;
+}
+
+
+/*
+	Select the conversion applied to the payload of transmitted and received
+	files. flags is a combination of POFO_TEXT_LINES and POFO_TEXT_CP437.
+	Files received into a tar archive are never converted.
+*/
+void pofoSetTextMode(POFO_SESSION *s, int flags)
+{
+	int i;
+
+	for (i=0; i<256; i++) {
+		s->toPofo[i] = i;
+		s->fromPofo[i] = i;
+	}
+
+	if (flags & POFO_TEXT_CP437) {
+		/* Characters without counterpart become '?' */
+		for (i=0x80; i<256; i++) {
+			s->toPofo[i] = '?';
+			s->fromPofo[i] = '?';
+		}
+		for (i=0xA0; i<256; i++) {
+			unsigned char c = latin1ToCp437[i-0xA0];
+			if (c) {
+				s->toPofo[i] = c;
+				s->fromPofo[c] = i;
+			}
+		}
+	}
+
+	s->textMode = flags;
+}
+
+
+/*
+	Open the parallel port. device selects the port device (ppdev) or the
+	port address (direct I/O), NULL selects the default.
+*/
+POFO_STATUS pofoOpen(POFO_SESSION *s, const char *device)
+{
+	s->errorText[0] = 0;
+	if (openPort(s, device) == -1) {
+		if (!s->errorText[0])
+			fail(s, POFO_ERR_PORT, "Cannot open parallel port!");
+		return POFO_ERR_PORT;
+	}
+	s->portOpen = 1;
+	return POFO_OK;
+}
+
+
+/*
+	Synchronize with the Portfolio in server mode. Also re-establishes the
+	link after a timeout or a protocol error in the middle of a session.
+
+	Each probe gives the Portfolio PROBE_MS to answer. Unanswered probes are
+	repeated with growing pauses until timeout ms have passed (0 = forever),
+	so the Portfolio may be switched to server mode later. A Portfolio that
+	answers but does not deliver the sync byte is half synchronized, e.g.
+	still in the middle of an aborted block, and is probed again after a
+	pause as well.
+
+	Returns POFO_ERR_TIMEOUT if the Portfolio never answered and
+	POFO_ERR_SYNC if it answered without getting in sync.
+*/
+POFO_STATUS pofoConnect(POFO_SESSION *s, long timeout)
+{
+	long start = nowMs();
+	long pause = PROBE_PAUSE_MS;
+	long savedTimeout = s->timeout;
+	int answered = 0;
+	int attempts = 0;
+
+	for (;;) {
+		unsigned char byte;
+		int shifts;
+
+		attempts++;
+		s->linkLost = 0;
+		s->timeout = PROBE_MS;
+
+		writePort(s, 2);
+		/* Later probes must not wait for the clock to rise: the Portfolio may
+		   have entered server mode during the pause and already pulled it low
+		   for the first bit. */
+		if (attempts == 1)
+			waitClockHigh(s);
+		byte = receiveByte(s);
+		/* synchronization */
+		for (shifts=0; byte != 90 && !s->linkLost && shifts < SYNC_SHIFTS; shifts++) {
+			waitClockLow(s);
+			writePort(s, 0);
+			waitClockHigh(s);
+			writePort(s, 2);
+			byte = receiveByte(s);
+		}
+
+		if (!s->linkLost && byte == 90)
+			break;
+
+		if (!s->linkLost) {
+			answered = 1;
+			report(s, "Link is half synchronized, probing again.");
+		}
+		else if (attempts == 1) {
+			report(s, "Portfolio does not answer, probing again.");
+		}
+
+		if (timeout && nowMs() - start + pause > timeout) {
+			s->timeout = savedTimeout;
+			s->linkLost = 0;
+			if (answered)
+				return fail(s, POFO_ERR_SYNC, "Portfolio does not get in sync!");
+			return fail(s, POFO_ERR_TIMEOUT, "Portfolio does not respond!");
+		}
+
+		/* Give the Portfolio time to drop an aborted block before the next probe */
+		sleepMs(pause);
+		if (pause < PROBE_MAX_PAUSE_MS)
+			pause *= 2;
+	}
+
+	s->timeout = savedTimeout;
+	s->syncTime = nowMs() - start;
+	report(s, "Synchronized after %ld ms (%d probe%s).", s->syncTime, attempts, attempts > 1 ? "s" : "");
+	return POFO_OK;
+}
+
+
+/*
+	Wait for Portfolio to enter server mode
+*/
+POFO_STATUS pofoSync(POFO_SESSION *s)
+{
+	return pofoConnect(s, 0);
+}
+
+
+/*
+	Give up an operation if the Portfolio leaves the clock line alone for
+	more than ms milliseconds (0 = wait forever, the default).
+	The link must be re-established with pofoConnect() afterwards.
+*/
+void pofoSetTimeout(POFO_SESSION *s, long ms)
+{
+	s->timeout = ms;
+}
+
+
+long pofoSyncTime(const POFO_SESSION *s)
+{
+	return s->syncTime;
+}
+
+
+/*
+	Set the number of consistent port reads that make a clock edge and the
+	number of votes on each data bit (rounded up to an odd number).
+	1 accepts the first read like the original implementation.
+*/
+void pofoSetSamples(POFO_SESSION *s, int samples)
+{
+	if (samples < 1)
+		samples = 1;
+	if (samples > POFO_MAX_SAMPLES)
+		samples = POFO_MAX_SAMPLES;
+	s->samples = samples;
+}
+
+
+/*
+	Link usage of the session so far
+*/
+void pofoGetCounters(const POFO_SESSION *s, POFO_COUNTERS *counters)
+{
+	*counters = s->counters;
+}
+
+
+/*
+	Add the blocks that an operation on a file of len bytes exchanges with
+	the Portfolio to plan, counted like pofoGetCounters() does. For
+	POFO_OP_LIST, len is ignored; receiving files also needs one list
+	request per pattern. overwrite adds the confirmation that is sent when
+	a transmitted file replaces an existing one.
+*/
+void pofoPlan(POFO_OPERATION op, long len, int overwrite, POFO_COUNTERS *plan)
+{
+	long blocks = (len + PLAN_BLOCKSIZE-1) / PLAN_BLOCKSIZE;
+
+	switch (op) {
+	case POFO_OP_LIST:
+		/* Request and list */
+		plan->bytes += sizeof(((POFO_SESSION*)0)->receiveInit);
+		plan->frames += 2;
+		break;
+	case POFO_OP_RECEIVE:
+		/* Request, length information, payload, finish */
+		plan->bytes += sizeof(((POFO_SESSION*)0)->receiveInit) + len + sizeof(receiveFinish);
+		plan->frames += 3 + blocks;
+		plan->files++;
+		break;
+	case POFO_OP_TRANSMIT:
+		/* Request, answer, payload, result */
+		plan->bytes += sizeof(((POFO_SESSION*)0)->transmitInit) + len;
+		plan->frames += 3 + blocks;
+		plan->files++;
+		if (overwrite) {
+			plan->bytes += sizeof(transmitOverwrite);
+			plan->frames++;
+		}
+		break;
+	}
+}
+
+
+/*
+	Number of rejected clock glitches and outvoted data samples so far
+*/
+unsigned long pofoGlitches(const POFO_SESSION *s)
+{
+	return s->glitches;
+}
+
+
+const char * pofoErrorText(const POFO_SESSION *s)
+{
+	return s->errorText;
+}
+
+
+const char * pofoStatusText(POFO_STATUS status)
+{
+	switch (status) {
+	case POFO_OK:                 return "OK";
+	case POFO_ERR_PORT:           return "Cannot open parallel port";
+	case POFO_ERR_MEMORY:         return "Out of memory";
+	case POFO_ERR_NOT_READY:      return "Portfolio not ready";
+	case POFO_ERR_ACKNOWLEDGE:    return "Acknowledge error";
+	case POFO_ERR_CHECKSUM:       return "Checksum error";
+	case POFO_ERR_BUFFER:         return "Buffer too small";
+	case POFO_ERR_PROTOCOL:       return "Protocol error";
+	case POFO_ERR_TIMEOUT:        return "Portfolio does not respond";
+	case POFO_ERR_SYNC:           return "Link not synchronized";
+	case POFO_ERR_FILE_NOT_FOUND: return "File not found";
+	case POFO_ERR_NOT_FOUND:      return "File not found on Portfolio";
+	case POFO_ERR_SKIPPED:        return "Skipped";
+	case POFO_ERR_INVALID_DEST:   return "Invalid destination file";
+	case POFO_ERR_EXISTS:         return "File exists";
+	case POFO_ERR_TRANSMISSION:   return "Transmission failed";
+	case POFO_ERR_CREATE:         return "Cannot create file";
+	case POFO_ERR_IO:             return "I/O error";
+	}
+	return "Unknown error";
+}
+
+
+/*
+	Execute a queued request and fill in its completion
+*/
+static void runJob(POFO_SESSION *s, POFO_JOB *job)
+{
+	POFO_REQUEST *r = &job->request;
+	POFO_COMPLETION *c = &job->completion;
+
+	s->currentId = c->id;
+	s->errorText[0] = 0;
+
+	switch (r->op) {
+	case POFO_OP_LIST:
+		c->status = listFiles(s, r->source, &c->names, &c->count);
+		break;
+	case POFO_OP_RECEIVE:
+		c->status = receiveFile(s, r->source, r->dest, r->force);
+		break;
+	case POFO_OP_TRANSMIT:
+		c->status = transmitFile(s, r->source, r->dest, r->force);
+		break;
+	default:
+		c->status = fail(s, POFO_ERR_PROTOCOL, "Unknown operation");
+	}
+
+	if (c->status != POFO_OK)
+		strcpy(c->errorText, s->errorText);
+	s->currentId = 0;
+
+	free((char*)r->source);
+	free((char*)r->dest);
+	r->source = r->dest = NULL;
+}
+
+
+/*
+	Move a finished job to the completion queue. Called with the lock held.
+*/
+static void completeJob(POFO_SESSION *s, POFO_JOB *job)
+{
+	job->next = NULL;
+	if (s->lastDone)
+		s->lastDone->next = job;
+	else
+		s->done = job;
+	s->lastDone = job;
+	s->outstanding--;
+}
+
+
+#if defined(POFO_THREADS)
+
+static void * worker(void *arg)
+{
+	POFO_SESSION *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		POFO_JOB *job;
+
+		while (!s->jobs && !s->stopping)
+			pthread_cond_wait(&s->jobAvailable, &s->lock);
+		if (!s->jobs)
+			break;
+
+		job = s->jobs;
+		s->jobs = job->next;
+		if (!s->jobs)
+			s->lastJob = NULL;
+
+		pthread_mutex_unlock(&s->lock);
+		runJob(s, job);
+		pthread_mutex_lock(&s->lock);
+
+		completeJob(s, job);
+		pthread_cond_broadcast(&s->jobDone);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+#endif
+
+
+/*
+	Queue a request for execution. Returns its id or 0 if out of memory.
+	Without thread support, the request is executed before returning.
+*/
+unsigned long pofoSubmit(POFO_SESSION *s, const POFO_REQUEST *request)
+{
+	POFO_JOB *job = calloc(1, sizeof(POFO_JOB));
+
+	if (job == NULL)
+		return 0;
+
+	job->request = *request;
+	job->request.source = request->source ? strdup(request->source) : NULL;
+	job->request.dest = request->dest ? strdup(request->dest) : NULL;
+	if ((request->source && !job->request.source) || (request->dest && !job->request.dest)) {
+		free((char*)job->request.source);
+		free((char*)job->request.dest);
+		free(job);
+		return 0;
+	}
+	job->completion.op = request->op;
+
+#if defined(POFO_THREADS)
+	pthread_mutex_lock(&s->lock);
+	if (!s->workerRunning) {
+		if (pthread_create(&s->worker, NULL, worker, s) != 0) {
+			pthread_mutex_unlock(&s->lock);
+			free((char*)job->request.source);
+			free((char*)job->request.dest);
+			free(job);
+			return 0;
+		}
+		s->workerRunning = 1;
+	}
+	job->completion.id = s->nextId++;
+	if (s->lastJob)
+		s->lastJob->next = job;
+	else
+		s->jobs = job;
+	s->lastJob = job;
+	s->outstanding++;
+	pthread_cond_signal(&s->jobAvailable);
+	pthread_mutex_unlock(&s->lock);
+#else
+	job->completion.id = s->nextId++;
+	s->outstanding++;
+	runJob(s, job);
+	completeJob(s, job);
+#endif
+
+	return job->completion.id;
+}
+
+
+/*
+	Take the next finished request from the completion queue.
+	Returns 1 if completion has been filled in, 0 if none is available.
+*/
+int pofoPoll(POFO_SESSION *s, POFO_COMPLETION *completion)
+{
+	POFO_JOB *job;
+
+#if defined(POFO_THREADS)
+	pthread_mutex_lock(&s->lock);
+#endif
+	job = s->done;
+	if (job) {
+		s->done = job->next;
+		if (!s->done)
+			s->lastDone = NULL;
+	}
+#if defined(POFO_THREADS)
+	pthread_mutex_unlock(&s->lock);
+#endif
+
+	if (!job)
+		return 0;
+
+	*completion = job->completion;
+	free(job);
+	return 1;
+}
+
+
+/*
+	Like pofoPoll() but waits until a request has finished.
+	Returns 0 if no request is outstanding.
+*/
+int pofoWait(POFO_SESSION *s, POFO_COMPLETION *completion)
+{
+#if defined(POFO_THREADS)
+	pthread_mutex_lock(&s->lock);
+	while (!s->done && s->outstanding > 0)
+		pthread_cond_wait(&s->jobDone, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+#endif
+
+	return pofoPoll(s, completion);
+}
+
+
+/*
+	Finish all submitted requests, close the port and release the session.
+	Completions that have not been collected are discarded.
+*/
+void pofoClose(POFO_SESSION *s)
+{
+	POFO_COMPLETION c;
+
+	if (s == NULL)
+		return;
+
+#if defined(POFO_THREADS)
+	if (s->workerRunning) {
+		pthread_mutex_lock(&s->lock);
+		s->stopping = 1;
+		pthread_cond_signal(&s->jobAvailable);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->worker, NULL);
+	}
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->jobAvailable);
+	pthread_cond_destroy(&s->jobDone);
+#endif
+
+	while (pofoPoll(s, &c))
+		free(c.names);
+
+	if (s->portOpen)
+		closePort(s);
+
+	free(s->payload);
+	free(s->controlData);
+	free(s->list);
+	free(s->frame);
+	free(s->text);
+	free(s->blob);
+	free(s);
+}
@@ -0,0 +1,176 @@
+/*
+  Pofo is the transfer library behind Transfolio. It implements the file
+  transfer protocol of the Atari Portfolio server mode on top of the
+  parallel port access method selected at compile time.
+
+  All state lives in a POFO_SESSION, no function calls exit() and nothing
+  is written to stdout or stderr. Messages, progress and errors are passed
+  to the callbacks of the session.
+
+  Operations can be called synchronously or submitted to the session's
+  worker thread with pofoSubmit(). Finished requests are collected from
+  the completion queue with pofoPoll() or pofoWait(). All requests of a
+  session are executed one after another since they share the link.
+  Callbacks of submitted requests are invoked from the worker thread.
+*/
+
+#ifndef POFO_H
+#define POFO_H
+
+#include <stdio.h>
+
+/* #define DIRECTIO */
+/* #define RASPIWIRING */
+
+#ifndef __DMC__
+#ifndef DIRECTIO
+#ifndef RASPIWIRING
+#ifndef PPDEV
+#define PPDEV            "/dev/parport0"
+#endif
+#endif
+#endif
+#endif
+
+#define DATAPORT          0x378
+#define MAX_FILENAME_LEN     79
+
+/* Default number of port reads per clock edge, see pofoSetSamples().
+   ppdev reads are ioctl calls and take much longer than the others. */
+#if defined(PPDEV)
+#define POFO_SAMPLES          2
+#else
+#define POFO_SAMPLES          3
+#endif
+#define POFO_MAX_SAMPLES     15
+
+/* Text conversion flags for pofoSetTextMode() */
+#define POFO_TEXT_LINES      1         /* LF -> CRLF on transmit, CRLF -> LF on receive */
+#define POFO_TEXT_CP437      2         /* ISO 8859-1 <-> code page 437 */
+
+#if !defined(__DMC__)
+#define POFO_THREADS                   /* Asynchronous requests use a worker thread */
+#endif
+
+
+typedef enum {
+	POFO_OK = 0,
+	POFO_ERR_PORT,                       /* Cannot open parallel port */
+	POFO_ERR_MEMORY,                     /* Out of memory */
+	POFO_ERR_NOT_READY,                  /* Portfolio not ready for receiving */
+	POFO_ERR_ACKNOWLEDGE,                /* Unexpected acknowledge byte */
+	POFO_ERR_CHECKSUM,                   /* Checksum mismatch */
+	POFO_ERR_BUFFER,                     /* Block does not fit into the buffer */
+	POFO_ERR_PROTOCOL,                   /* Unexpected answer from the Portfolio */
+	POFO_ERR_FILE_NOT_FOUND,             /* Source file not found on the PC */
+	POFO_ERR_NOT_FOUND,                  /* Source file not found on the Portfolio */
+	POFO_ERR_SKIPPED,                    /* Directory or huge file was not sent */
+	POFO_ERR_INVALID_DEST,               /* Invalid destination file on the Portfolio */
+	POFO_ERR_EXISTS,                     /* Destination exists and force is not set */
+	POFO_ERR_TRANSMISSION,               /* Disk full or directory does not exist */
+	POFO_ERR_CREATE,                     /* Cannot create file on the PC */
+	POFO_ERR_IO,                         /* Read, write or seek error on the PC */
+	POFO_ERR_TIMEOUT,                    /* Portfolio does not respond */
+	POFO_ERR_SYNC                        /* Portfolio answers but the link is not in sync */
+} POFO_STATUS;
+
+
+typedef enum {
+	POFO_OP_LIST = 0,
+	POFO_OP_RECEIVE,
+	POFO_OP_TRANSMIT
+} POFO_OPERATION;
+
+
+typedef struct POFO_SESSION POFO_SESSION;
+
+
+/*
+	Link usage, counted by a session or predicted by pofoPlan()
+*/
+typedef struct {
+	long bytes;                          /* Bytes in payload and sent control blocks */
+	long frames;                         /* Blocks exchanged, each with its own handshake */
+	long files;                          /* Files transferred completely */
+} POFO_COUNTERS;
+
+
+/*
+	Callbacks of a session. Any of them may be NULL.
+	id is the request id returned by pofoSubmit() or 0 for synchronous calls.
+*/
+typedef struct {
+	/* Informational message, e.g. about the number of blocks */
+	void (*message)(void *user, unsigned long id, const char *text);
+	/* A file is about to be transferred. index counts all files of the session,
+	   count is the number of files matched by the current request. */
+	void (*file)(void *user, unsigned long id, int index, int count, const char *name);
+	/* Payload bytes of the current block */
+	void (*progress)(void *user, unsigned long id, long done, long total);
+} POFO_CALLBACKS;
+
+
+/*
+	Asynchronous request. The strings are copied by pofoSubmit().
+	dest is ignored for POFO_OP_LIST.
+*/
+typedef struct {
+	POFO_OPERATION op;
+	const char *source;
+	const char *dest;
+	int force;
+} POFO_REQUEST;
+
+
+/*
+	Result of a request taken from the completion queue.
+	For POFO_OP_LIST, names holds count NUL terminated names and must be
+	released with free().
+*/
+typedef struct {
+	unsigned long id;
+	POFO_OPERATION op;
+	POFO_STATUS status;
+	char errorText[128];
+	char *names;
+	int count;
+} POFO_COMPLETION;
+
+
+/* Session handling */
+POFO_SESSION * pofoCreate(void);
+void pofoSetCallbacks(POFO_SESSION *s, const POFO_CALLBACKS *callbacks, void *user);
+void pofoSetTextMode(POFO_SESSION *s, int flags);
+POFO_STATUS pofoOpen(POFO_SESSION *s, const char *device);
+POFO_STATUS pofoSync(POFO_SESSION *s);
+POFO_STATUS pofoConnect(POFO_SESSION *s, long timeout);
+void pofoSetTimeout(POFO_SESSION *s, long ms);
+long pofoSyncTime(const POFO_SESSION *s);
+void pofoSetSamples(POFO_SESSION *s, int samples);
+unsigned long pofoGlitches(const POFO_SESSION *s);
+void pofoGetCounters(const POFO_SESSION *s, POFO_COUNTERS *counters);
+void pofoPlan(POFO_OPERATION op, long len, int overwrite, POFO_COUNTERS *plan);
+void pofoClose(POFO_SESSION *s);
+const char * pofoErrorText(const POFO_SESSION *s);
+const char * pofoStatusText(POFO_STATUS status);
+
+/* Synchronous operations */
+POFO_STATUS transmitStream(POFO_SESSION *s, FILE *file, int len, const char *dest, int force);
+POFO_STATUS transmitFile(POFO_SESSION *s, const char *source, const char *dest, int force);
+POFO_STATUS transmitArchive(POFO_SESSION *s, const char *source, char *dest, int force);
+POFO_STATUS receiveFile(POFO_SESSION *s, const char *source, const char *dest, int force);
+POFO_STATUS receiveArchive(POFO_SESSION *s, const char *source, FILE *archive);
+POFO_STATUS receiveStream(POFO_SESSION *s, const char *source, FILE *stream);
+POFO_STATUS receiveStore(POFO_SESSION *s, const char *source, const char *store, const char *snapshot, int force);
+POFO_STATUS listFiles(POFO_SESSION *s, const char *pattern, char **names, int *count);
+
+/* Asynchronous operations */
+unsigned long pofoSubmit(POFO_SESSION *s, const POFO_REQUEST *request);
+int pofoPoll(POFO_SESSION *s, POFO_COMPLETION *completion);
+int pofoWait(POFO_SESSION *s, POFO_COMPLETION *completion);
+
+/* Helpers */
+void composePofoName(const char *source, const char *dest, char *pofoName, int sourcecount);
+void closeTarArchive(FILE *file);
+
+#endif
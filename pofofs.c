@@ -0,0 +1,976 @@
+/*
+  Pofofs mounts the drives of an Atari Portfolio in server mode as a FUSE
+  filesystem. It uses the list, receive and transmit operations of the pofo
+  library, so every access is a transfer over the parallel port.
+
+  To avoid repeated transfers over the slow link:
+  - Directory listings are cached for a configurable time (-t).
+  - The content of a file is transferred completely when it is opened and
+    kept in memory. The Portfolio does not report file sizes in its
+    directory listing, so stat() reports the size of the cached copy and
+    UNKNOWN_SIZE before the file has been read. The kernel does not cache
+    these attributes, so the real size shows up once the file is open,
+    including in fstat() on the open file. Files are opened with direct
+    I/O, so reads are not cut off at a size seen before.
+  - Writes only modify the cached copy. The file is sent to the Portfolio
+    once when it is closed.
+  - When a file has been read to its end, the next file of the same
+    directory is prefetched while the link is idle.
+
+  The link and the caches have separate locks, so requests that can be
+  answered from the caches never wait for a transfer. A transfer in
+  progress cannot be interrupted, but a prefetch is not started while
+  another request is waiting for the link.
+
+  The protocol can neither delete nor rename files, so unlink() and
+  rename() are not supported.
+
+  Compiling: see the pofofs target of the Makefile (requires libfuse 3)
+  Usage:     pofofs [-d DEVICE] [-D DRIVES] [-t SECONDS] MOUNTPOINT [FUSE options]
+*/
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pofo.h"
+
+#define DEFAULT_DRIVES       "C"
+#define DEFAULT_TTL           30       /* Seconds a directory listing is valid */
+#define UNKNOWN_SIZE           0       /* Size reported before the content is cached */
+
+
+/* Cached content of a file on the Portfolio */
+typedef struct CACHED_FILE {
+	struct CACHED_FILE *next;
+	char path[MAX_FILENAME_LEN+1];       /* DOS path, e.g. C:\DIR\FILE.TXT */
+	char *data;
+	size_t size;
+	int valid;                           /* data holds the file content */
+	int dirty;                           /* data has to be sent to the Portfolio */
+	int fetching;                        /* Content is being received */
+	unsigned long version;               /* Incremented by every modification */
+	int openCount;
+	time_t mtime;
+} CACHED_FILE;
+
+
+/* Cached directory listing */
+typedef struct CACHED_DIR {
+	struct CACHED_DIR *next;
+	char path[MAX_FILENAME_LEN+1];       /* DOS path with trailing backslash */
+	char *names;
+	int count;
+	time_t fetched;
+} CACHED_DIR;
+
+
+typedef struct {
+	POFO_SESSION *session;
+	pthread_mutex_t link;                /* Serializes transfers */
+	pthread_mutex_t lock;                /* Protects the caches */
+	int waiting;                         /* Requests waiting for the link */
+	pthread_cond_t fetched;              /* A file is no longer fetching */
+	const char *drives;
+	int ttl;
+	time_t mounted;
+	CACHED_DIR *dirs;
+	CACHED_FILE *files;
+
+	/* Prefetching */
+	pthread_t prefetcher;
+	pthread_cond_t prefetchWanted;
+	char prefetchPath[MAX_FILENAME_LEN+1];
+	int stopping;
+} POFOFS;
+
+
+static POFOFS * getFs(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+
+/*
+	Translate a path of the mounted filesystem ("/C/DIR/FILE.TXT") into a
+	DOS path ("C:\DIR\FILE.TXT"). Returns -ENOENT for unknown drives.
+*/
+static int toDosPath(POFOFS *fs, const char *path, char *dos)
+{
+	char *pos;
+
+	if (path[0] != '/' || !path[1] || (path[2] && path[2] != '/') ||
+			!strchr(fs->drives, toupper((unsigned char)path[1])))
+		return -ENOENT;
+
+	if (strlen(path) + 1 > MAX_FILENAME_LEN)
+		return -ENAMETOOLONG;
+
+	dos[0] = toupper((unsigned char)path[1]);
+	dos[1] = ':';
+	dos[2] = '\\';
+	strcpy(dos+3, path[2] ? path+3 : "");
+
+	while ((pos = strchr(dos, '/'))) {
+		*pos = '\\';
+	}
+
+	return 0;
+}
+
+
+/*
+	Split a DOS path into its directory (with trailing backslash) and name
+*/
+static const char * splitDosPath(const char *dos, char *dir)
+{
+	const char *name = strrchr(dos, '\\') + 1;
+
+	memcpy(dir, dos, name - dos);
+	dir[name - dos] = 0;
+
+	return name;
+}
+
+
+static int statusToErrno(POFO_STATUS status)
+{
+	switch (status) {
+	case POFO_OK:             return 0;
+	case POFO_ERR_NOT_FOUND:  return -ENOENT;
+	case POFO_ERR_MEMORY:     return -ENOMEM;
+	case POFO_ERR_INVALID_DEST:
+	case POFO_ERR_TRANSMISSION:
+		return -ENOSPC;
+	default:                  return -EIO;
+	}
+}
+
+
+/*
+	Acquire the link for a transfer. Called with the cache lock held, which
+	is released while waiting and held again on return. A prefetch gives
+	the link up again and returns -1 if another request is waiting for it.
+	The link has to be locked first, so the cache lock is released before
+	waiting.
+*/
+static int acquireLink(POFOFS *fs, int prefetch)
+{
+	if (!prefetch)
+		fs->waiting++;
+	pthread_mutex_unlock(&fs->lock);
+	pthread_mutex_lock(&fs->link);
+	pthread_mutex_lock(&fs->lock);
+	if (!prefetch) {
+		fs->waiting--;
+	}
+	else if (fs->waiting) {
+		pthread_mutex_unlock(&fs->link);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+	Get the listing of a directory, from the cache if it is recent enough.
+	Returns NULL if the directory cannot be listed. Called with the cache
+	lock held, which is released during a transfer.
+*/
+static CACHED_DIR * getDir(POFOFS *fs, const char *dir)
+{
+	POFO_STATUS status;
+	CACHED_DIR *d;
+	char pattern[MAX_FILENAME_LEN+1];
+	char *names;
+	int count;
+
+	for (d = fs->dirs; d; d = d->next) {
+		if (strcasecmp(d->path, dir) == 0)
+			break;
+	}
+
+	if (d && time(NULL) - d->fetched < fs->ttl)
+		return d;
+
+	acquireLink(fs, 0);
+
+	/* Another request may have listed the directory in the meantime */
+	for (d = fs->dirs; d; d = d->next) {
+		if (strcasecmp(d->path, dir) == 0)
+			break;
+	}
+	if (d && time(NULL) - d->fetched < fs->ttl) {
+		pthread_mutex_unlock(&fs->link);
+		return d;
+	}
+
+	snprintf(pattern, sizeof(pattern), "%s*.*", dir);
+	pthread_mutex_unlock(&fs->lock);
+	status = listFiles(fs->session, pattern, &names, &count);
+	pthread_mutex_lock(&fs->lock);
+	pthread_mutex_unlock(&fs->link);
+	if (status != POFO_OK)
+		return NULL;
+
+	/* Entries are never removed, but one may have been added */
+	for (d = fs->dirs; d; d = d->next) {
+		if (strcasecmp(d->path, dir) == 0)
+			break;
+	}
+	if (!d) {
+		d = calloc(1, sizeof(CACHED_DIR));
+		if (!d) {
+			free(names);
+			return NULL;
+		}
+		strcpy(d->path, dir);
+		d->next = fs->dirs;
+		fs->dirs = d;
+	}
+
+	free(d->names);
+	d->names = names;
+	d->count = count;
+	d->fetched = time(NULL);
+
+	return d;
+}
+
+
+/*
+	Returns the name following name in the listing, "" if name is the last
+	one and NULL if it is not listed.
+*/
+static const char * findName(const CACHED_DIR *d, const char *name)
+{
+	const char *n = d->names;
+	int i;
+
+	for (i=0; i<d->count; i++) {
+		const char *next = n + strlen(n) + 1;
+		if (strcasecmp(n, name) == 0)
+			return i+1 < d->count ? next : "";
+		n = next;
+	}
+
+	return NULL;
+}
+
+
+static CACHED_FILE * findFile(POFOFS *fs, const char *dos)
+{
+	CACHED_FILE *f;
+
+	for (f = fs->files; f; f = f->next) {
+		if (strcasecmp(f->path, dos) == 0)
+			return f;
+	}
+
+	return NULL;
+}
+
+
+static CACHED_FILE * addFile(POFOFS *fs, const char *dos)
+{
+	CACHED_FILE *f = calloc(1, sizeof(CACHED_FILE));
+
+	if (f) {
+		strcpy(f->path, dos);
+		f->mtime = fs->mounted;
+		f->next = fs->files;
+		fs->files = f;
+	}
+
+	return f;
+}
+
+
+/*
+	Make sure the content of a file is cached, receiving it if necessary.
+	Called with the cache lock held, which is released during the transfer.
+	A prefetch returns -EAGAIN instead of delaying another request.
+*/
+static int fetchFile(POFOFS *fs, CACHED_FILE *f, int prefetch)
+{
+	POFO_STATUS status;
+	FILE *stream;
+	char *data;
+	size_t size;
+
+	/* Wait for a transfer of the same file, e.g. by the prefetcher */
+	while (f->fetching)
+		pthread_cond_wait(&fs->fetched, &fs->lock);
+
+	if (f->valid)
+		return 0;
+
+	if (acquireLink(fs, prefetch) != 0)
+		return -EAGAIN;
+
+	/* Truncated or created while waiting */
+	if (f->valid) {
+		pthread_mutex_unlock(&fs->link);
+		return 0;
+	}
+
+	stream = open_memstream(&data, &size);
+	if (!stream) {
+		pthread_mutex_unlock(&fs->link);
+		return -ENOMEM;
+	}
+
+	f->fetching = 1;
+	pthread_mutex_unlock(&fs->lock);
+	status = receiveStream(fs->session, f->path, stream);
+	fclose(stream);
+	pthread_mutex_lock(&fs->lock);
+	pthread_mutex_unlock(&fs->link);
+	f->fetching = 0;
+	pthread_cond_broadcast(&fs->fetched);
+
+	if (status != POFO_OK) {
+		free(data);
+		return statusToErrno(status);
+	}
+
+	/* Truncated or created while receiving */
+	if (f->valid) {
+		free(data);
+		return 0;
+	}
+
+	free(f->data);
+	f->data = data;
+	f->size = size;
+	f->valid = 1;
+
+	return 0;
+}
+
+
+/*
+	Send the cached content of a modified file to the Portfolio. Called with
+	the cache lock held, which is released during the transfer. A copy of
+	the content is sent, as it may be modified in the meantime.
+*/
+static int pushFile(POFOFS *fs, CACHED_FILE *f)
+{
+	POFO_STATUS status;
+	FILE *stream;
+	char *data;
+	size_t size;
+	unsigned long version;
+
+	if (!f->dirty)
+		return 0;
+
+	acquireLink(fs, 0);
+
+	/* Sent by another request in the meantime */
+	if (!f->dirty) {
+		pthread_mutex_unlock(&fs->link);
+		return 0;
+	}
+
+	/* fmemopen() does not accept empty buffers */
+	size = f->size;
+	data = malloc(size ? size : 1);
+	if (!data) {
+		pthread_mutex_unlock(&fs->link);
+		return -ENOMEM;
+	}
+	memcpy(data, f->data, size);
+	version = f->version;
+
+	pthread_mutex_unlock(&fs->lock);
+	stream = fmemopen(data, size ? size : 1, "rb");
+	if (stream) {
+		status = transmitStream(fs->session, stream, size, f->path, 1);
+		fclose(stream);
+	}
+	else {
+		status = POFO_ERR_MEMORY;
+	}
+	free(data);
+	pthread_mutex_lock(&fs->lock);
+	pthread_mutex_unlock(&fs->link);
+
+	if (status != POFO_OK)
+		return statusToErrno(status);
+
+	if (f->version == version)
+		f->dirty = 0;
+	f->mtime = time(NULL);
+
+	/* The next listing has to show the file */
+	{
+		char dir[MAX_FILENAME_LEN+1];
+		CACHED_DIR *d;
+
+		splitDosPath(f->path, dir);
+		for (d = fs->dirs; d; d = d->next) {
+			if (strcasecmp(d->path, dir) == 0)
+				d->fetched = 0;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+	Look up a file of the Portfolio. Returns NULL if it does not exist.
+*/
+static CACHED_FILE * lookupFile(POFOFS *fs, const char *dos)
+{
+	CACHED_FILE *f = findFile(fs, dos);
+	char dir[MAX_FILENAME_LEN+1];
+	const char *name = splitDosPath(dos, dir);
+	CACHED_DIR *d;
+
+	if (f && (f->dirty || f->openCount))
+		return f;
+
+	d = getDir(fs, dir);
+	if (!d || !findName(d, name))
+		return NULL;
+
+	return f ? f : addFile(fs, dos);
+}
+
+
+/*
+	Request prefetching of the file following f in its directory
+*/
+static void prefetchNext(POFOFS *fs, CACHED_FILE *f)
+{
+	char dir[MAX_FILENAME_LEN+1];
+	const char *name = splitDosPath(f->path, dir);
+	const char *next;
+	CACHED_DIR *d;
+
+	for (d = fs->dirs; d; d = d->next) {
+		if (strcasecmp(d->path, dir) == 0)
+			break;
+	}
+	if (!d || !(next = findName(d, name)) || !*next)
+		return;
+
+	if (strlen(dir) + strlen(next) > MAX_FILENAME_LEN)
+		return;
+	snprintf(fs->prefetchPath, sizeof(fs->prefetchPath), "%s%s", dir, next);
+	pthread_cond_signal(&fs->prefetchWanted);
+}
+
+
+static void * prefetcher(void *arg)
+{
+	POFOFS *fs = arg;
+
+	pthread_mutex_lock(&fs->lock);
+	for (;;) {
+		CACHED_FILE *f;
+
+		while (!fs->prefetchPath[0] && !fs->stopping)
+			pthread_cond_wait(&fs->prefetchWanted, &fs->lock);
+		if (fs->stopping)
+			break;
+
+		f = findFile(fs, fs->prefetchPath);
+		if (!f)
+			f = addFile(fs, fs->prefetchPath);
+		fs->prefetchPath[0] = 0;
+
+		/* Dropped if a request is waiting for the link */
+		if (f)
+			fetchFile(fs, f, 1);
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	return NULL;
+}
+
+
+static int fsGetattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	POFOFS *fs = getFs();
+	char dos[MAX_FILENAME_LEN+1];
+	char pattern[MAX_FILENAME_LEN+1];
+	CACHED_FILE *f;
+	int res;
+
+	memset(st, 0, sizeof(*st));
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_mtime = st->st_atime = st->st_ctime = fs->mounted;
+
+	if (strcmp(path, "/") == 0) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return 0;
+	}
+
+	if ((res = toDosPath(fs, path, dos)) != 0)
+		return res;
+
+	if (strlen(dos) == 3) {
+		/* Drive */
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return 0;
+	}
+
+	pthread_mutex_lock(&fs->lock);
+
+	/* Answered from the listing; the content is only transferred by open() */
+	f = fi && fi->fh ? (CACHED_FILE*)(uintptr_t)fi->fh : lookupFile(fs, dos);
+	if (f) {
+		st->st_mode = S_IFREG | 0644;
+		st->st_nlink = 1;
+		st->st_size = f->valid ? f->size : UNKNOWN_SIZE;
+		st->st_mtime = f->mtime;
+		res = 0;
+	}
+	else {
+		/* Not a file, maybe a directory */
+		CACHED_DIR *d;
+
+		snprintf(pattern, sizeof(pattern), "%s\\", dos);
+		d = getDir(fs, pattern);
+		if (d && d->count) {
+			st->st_mode = S_IFDIR | 0755;
+			st->st_nlink = 2;
+			res = 0;
+		}
+		else {
+			res = -ENOENT;
+		}
+	}
+
+	pthread_mutex_unlock(&fs->lock);
+	return res;
+}
+
+
+static int fsReaddir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+										 struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	POFOFS *fs = getFs();
+	char dos[MAX_FILENAME_LEN+1];
+	char dir[MAX_FILENAME_LEN+1];
+	CACHED_DIR *d;
+	CACHED_FILE *f;
+	const char *name;
+	int i, res;
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+
+	if (strcmp(path, "/") == 0) {
+		for (i=0; fs->drives[i]; i++) {
+			char drive[2] = { fs->drives[i], 0 };
+			filler(buf, drive, NULL, 0, 0);
+		}
+		return 0;
+	}
+
+	if ((res = toDosPath(fs, path, dos)) != 0)
+		return res;
+	snprintf(dir, sizeof(dir), "%s%s", dos, strlen(dos) == 3 ? "" : "\\");
+
+	pthread_mutex_lock(&fs->lock);
+
+	d = getDir(fs, dir);
+	if (!d) {
+		pthread_mutex_unlock(&fs->lock);
+		return -EIO;
+	}
+
+	name = d->names;
+	for (i=0; i<d->count; i++) {
+		filler(buf, name, NULL, 0, 0);
+		name += strlen(name) + 1;
+	}
+
+	/* Files created but not sent yet */
+	for (f = fs->files; f; f = f->next) {
+		char fileDir[MAX_FILENAME_LEN+1];
+		name = splitDosPath(f->path, fileDir);
+		if (f->dirty && strcasecmp(fileDir, dir) == 0 && !findName(d, name))
+			filler(buf, name, NULL, 0, 0);
+	}
+
+	pthread_mutex_unlock(&fs->lock);
+	return 0;
+}
+
+
+static int fsOpen(const char *path, struct fuse_file_info *fi)
+{
+	POFOFS *fs = getFs();
+	char dos[MAX_FILENAME_LEN+1];
+	CACHED_FILE *f;
+	int res;
+
+	if ((res = toDosPath(fs, path, dos)) != 0)
+		return res;
+
+	pthread_mutex_lock(&fs->lock);
+
+	f = lookupFile(fs, dos);
+	if (!f) {
+		res = -ENOENT;
+	}
+	else if (fi->flags & O_TRUNC) {
+		free(f->data);
+		f->data = NULL;
+		f->size = 0;
+		f->valid = 1;
+		f->dirty = 1;
+		f->version++;
+	}
+	else {
+		res = fetchFile(fs, f, 0);
+	}
+
+	if (res == 0) {
+		f->openCount++;
+		fi->fh = (uint64_t)(uintptr_t)f;
+		/* stat() may have reported UNKNOWN_SIZE */
+		fi->direct_io = 1;
+	}
+
+	pthread_mutex_unlock(&fs->lock);
+	return res;
+}
+
+
+static int fsCreate(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	POFOFS *fs = getFs();
+	char dos[MAX_FILENAME_LEN+1];
+	CACHED_FILE *f;
+	int res;
+
+	if ((res = toDosPath(fs, path, dos)) != 0)
+		return res;
+
+	pthread_mutex_lock(&fs->lock);
+
+	f = findFile(fs, dos);
+	if (!f)
+		f = addFile(fs, dos);
+	if (f) {
+		free(f->data);
+		f->data = NULL;
+		f->size = 0;
+		f->valid = 1;
+		f->dirty = 1;
+		f->version++;
+		f->openCount++;
+		fi->fh = (uint64_t)(uintptr_t)f;
+		fi->direct_io = 1;
+	}
+	else {
+		res = -ENOMEM;
+	}
+
+	pthread_mutex_unlock(&fs->lock);
+	return res;
+}
+
+
+static int fsRead(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	POFOFS *fs = getFs();
+	CACHED_FILE *f = (CACHED_FILE*)(uintptr_t)fi->fh;
+	int res;
+
+	pthread_mutex_lock(&fs->lock);
+
+	if (offset >= f->size) {
+		res = 0;
+	}
+	else {
+		if (offset + size > f->size)
+			size = f->size - offset;
+		memcpy(buf, f->data + offset, size);
+		res = size;
+	}
+
+	/* Sequential reader reached the end of the file */
+	if (offset + size >= f->size && !f->dirty)
+		prefetchNext(fs, f);
+
+	pthread_mutex_unlock(&fs->lock);
+	return res;
+}
+
+
+/*
+	Change the size of the cached copy. Called with the lock held.
+*/
+static int resizeFile(CACHED_FILE *f, size_t size)
+{
+	if (size > f->size) {
+		char *data = realloc(f->data, size);
+		if (!data)
+			return -ENOMEM;
+		memset(data + f->size, 0, size - f->size);
+		f->data = data;
+	}
+	f->size = size;
+	f->dirty = 1;
+	f->version++;
+
+	return 0;
+}
+
+
+static int fsWrite(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	POFOFS *fs = getFs();
+	CACHED_FILE *f = (CACHED_FILE*)(uintptr_t)fi->fh;
+	int res = 0;
+
+	if (offset + size > 32*1024*1024)
+		return -EFBIG;
+
+	pthread_mutex_lock(&fs->lock);
+
+	if (offset + size > f->size)
+		res = resizeFile(f, offset + size);
+	if (res == 0) {
+		memcpy(f->data + offset, buf, size);
+		f->dirty = 1;
+		f->version++;
+		res = size;
+	}
+
+	pthread_mutex_unlock(&fs->lock);
+	return res;
+}
+
+
+static int fsTruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	POFOFS *fs = getFs();
+	char dos[MAX_FILENAME_LEN+1];
+	CACHED_FILE *f = NULL;
+	int res;
+
+	if (size > 32*1024*1024)
+		return -EFBIG;
+
+	pthread_mutex_lock(&fs->lock);
+
+	if (fi) {
+		f = (CACHED_FILE*)(uintptr_t)fi->fh;
+		res = 0;
+	}
+	else if ((res = toDosPath(fs, path, dos)) == 0) {
+		f = lookupFile(fs, dos);
+		if (!f)
+			res = -ENOENT;
+		else if (size)
+			res = fetchFile(fs, f, 0);
+		else
+			f->valid = 1;
+	}
+
+	if (res == 0)
+		res = resizeFile(f, size);
+
+	/* Without an open handle, there will be no flush */
+	if (res == 0 && !f->openCount)
+		res = pushFile(fs, f);
+
+	pthread_mutex_unlock(&fs->lock);
+	return res;
+}
+
+
+static int fsFlush(const char *path, struct fuse_file_info *fi)
+{
+	POFOFS *fs = getFs();
+	CACHED_FILE *f = (CACHED_FILE*)(uintptr_t)fi->fh;
+	int res;
+
+	pthread_mutex_lock(&fs->lock);
+	res = pushFile(fs, f);
+	pthread_mutex_unlock(&fs->lock);
+
+	return res;
+}
+
+
+static int fsRelease(const char *path, struct fuse_file_info *fi)
+{
+	POFOFS *fs = getFs();
+	CACHED_FILE *f = (CACHED_FILE*)(uintptr_t)fi->fh;
+	int res;
+
+	pthread_mutex_lock(&fs->lock);
+	res = pushFile(fs, f);
+	f->openCount--;
+	pthread_mutex_unlock(&fs->lock);
+
+	/* The kernel ignores the result of release(), so report it here */
+	if (res != 0)
+		fprintf(stderr, "Cannot send %s: %s\n", f->path, strerror(-res));
+
+	return res;
+}
+
+
+static int fsUtimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+	/* The Portfolio keeps its own time stamps */
+	return 0;
+}
+
+
+static void * fsInit(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	POFOFS *fs = getFs();
+
+	/* O_TRUNC is handled in open() to avoid sending an empty file first */
+	conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+	/* The size changes from UNKNOWN_SIZE to the real one when a file is
+	   opened. getattr() needs no transfer, so it is asked every time. */
+	cfg->attr_timeout = 0;
+	cfg->entry_timeout = fs->ttl;
+
+	pthread_create(&fs->prefetcher, NULL, prefetcher, fs);
+
+	return fs;
+}
+
+
+static void fsDestroy(void *private_data)
+{
+	POFOFS *fs = private_data;
+	CACHED_FILE *f;
+
+	pthread_mutex_lock(&fs->lock);
+	fs->stopping = 1;
+	pthread_cond_signal(&fs->prefetchWanted);
+	for (f = fs->files; f; f = f->next) {
+		int res = pushFile(fs, f);
+		if (res != 0)
+			fprintf(stderr, "Cannot send %s: %s\n", f->path, strerror(-res));
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	pthread_join(fs->prefetcher, NULL);
+}
+
+
+static const struct fuse_operations operations = {
+	.init     = fsInit,
+	.destroy  = fsDestroy,
+	.getattr  = fsGetattr,
+	.readdir  = fsReaddir,
+	.open     = fsOpen,
+	.create   = fsCreate,
+	.read     = fsRead,
+	.write    = fsWrite,
+	.truncate = fsTruncate,
+	.flush    = fsFlush,
+	.release  = fsRelease,
+	.utimens  = fsUtimens,
+};
+
+
+int main(int argc, char* argv[])
+{
+	static POFOFS fs;
+	const char * device = NULL;
+	char ** fuseArgv;
+	int fuseArgc = 1;
+	int i, res;
+
+	fs.drives = DEFAULT_DRIVES;
+	fs.ttl = DEFAULT_TTL;
+	fs.mounted = time(NULL);
+
+	/*
+		Own options come first, everything else is passed to FUSE
+	*/
+	fuseArgv = malloc((argc + 2) * sizeof(char*));
+	if (fuseArgv == NULL) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	fuseArgv[0] = argv[0];
+
+	for (i=1; i<argc; i++) {
+		if (strcmp(argv[i], "-d") == 0 && i+1 < argc) {
+			device = argv[++i];
+		}
+		else if (strcmp(argv[i], "-D") == 0 && i+1 < argc) {
+			char *pos;
+			fs.drives = argv[++i];
+			for (pos = argv[i]; *pos; pos++)
+				*pos = toupper((unsigned char)*pos);
+		}
+		else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+			fs.ttl = atoi(argv[++i]);
+		}
+		else {
+			fuseArgv[fuseArgc++] = argv[i];
+		}
+	}
+
+	if (fuseArgc < 2) {
+		printf("Syntax: %s [-d DEVICE] [-D DRIVES] [-t SECONDS] MOUNTPOINT [FUSE options]\n\n", argv[0]);
+		printf("-d  Select parallel port device or address\n");
+		printf("-D  Drive letters to expose (default: %s)\n", DEFAULT_DRIVES);
+		printf("-t  Seconds to cache directory listings (default: %d)\n", DEFAULT_TTL);
+		printf("\nThe Portfolio must be in server mode when running this program!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fuseArgv[fuseArgc] = NULL;
+
+	fs.session = pofoCreate();
+	if (fs.session == NULL) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pofoOpen(fs.session, device) != POFO_OK) {
+		fprintf(stderr, "%s\n", pofoErrorText(fs.session));
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stderr, "Waiting for Portfolio...\n");
+	if (pofoSync(fs.session) != POFO_OK) {
+		fprintf(stderr, "%s\n", pofoErrorText(fs.session));
+		pofoClose(fs.session);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_init(&fs.link, NULL);
+	pthread_mutex_init(&fs.lock, NULL);
+	pthread_cond_init(&fs.fetched, NULL);
+	pthread_cond_init(&fs.prefetchWanted, NULL);
+
+	res = fuse_main(fuseArgc, fuseArgv, &operations, &fs);
+
+	pofoClose(fs.session);
+	free(fuseArgv);
+
+	return res;
+}
@@ -4,7 +4,7 @@
   file transfer software of the Portfolio.
 
   Instructions:
-  - Adapt the source to select the parallel port access method
+  - Adapt pofo.h to select the parallel port access method
     or to change the default port address.
     Linux:
     - Either adapt PPDEV to match your parallel port device.
@@ -16,8 +16,8 @@
     - Either get the inpout32.dll library for Win NT/2000/XP (from http://www.logix4u.net)
     - Or define DIRECTIO which will not require any DLL but works
       for Win95 and Win98 only.
-  - Compiling for Linux:   cc -O3 transfolio.c -o transfolio
-    Compiling for Windows: dmc.exe transfolio.c
+  - Compiling for Linux:   cc -O3 transfolio.c pofo.c -lpthread -o transfolio
+    Compiling for Windows: dmc.exe transfolio.c pofo.c
   - Start file transfer in server mode on Portfolio
   - Run Transfolio on the PC
     Example for running with root permissions and quoting of a backslash:
@@ -70,801 +70,788 @@
        - Replaced usleep() by nanosleep() for the Linux build.
        - Updated included header file for open() function.
        - Made some inline functions static.
+  1.1  New/changed features:
+       - Archive mode (-a): Transmit the members of tar archives and
+         receive files directly into a tar archive.
+       - Watch mode (-w, Linux only): Send files of a directory to the
+         Portfolio as soon as they have been changed.
+       - Text mode (-x, -c): Convert line endings and characters while
+         transferring instead of in a separate pass.
+       - Link timeout (-s): Give up if the Portfolio does not answer in
+         time instead of waiting forever. The time until the link is
+         synchronized is reported. Script and watch mode re-establish
+         the link after a timeout or protocol error.
+       - Source lists (@FILE): Read the sources from a file or stdin one
+         at a time, optionally with an individual destination each.
+       - Clock edges are only accepted after several consistent reads and
+         data bits are sampled by majority vote (-n). Rejected glitches
+         are reported.
+       - Transfer times are predicted by a link model that learns from
+         previous runs on the same host. Dry run (-e) shows the estimate
+         for each file without transferring anything.
+       - Backup store (-k): Received files are stored once per content in
+         a deduplicating store and snapshot directories link to them.
+       Optimizations:
+       - Blocks are encoded before transmission and sendByte() only outputs
+         precomputed port values between the clock edges.
+       Cleanup:
+       - The protocol code has moved into the reentrant pofo library
+         (pofo.c, pofo.h) with an asynchronous request interface.
+         This file only contains the command line interface.
+       - New program pofofs mounts the Portfolio as a FUSE filesystem.
+       - Script mode (-b): Run list, get, put and overwrite commands from
+         a file or stdin in a single session.
 
 
   Klaus Peichl, 2006-01-22
 */
 
-/* #define DIRECTIO */
-/* #define RASPIWIRING */
-
-#ifndef __DMC__
-#ifndef DIRECTIO
-#ifndef RASPIWIRING
-#define PPDEV            "/dev/parport0"
-#endif
-#endif
-#define DATAPORT          0x378
-#define PAYLOAD_BUFSIZE   60000
-#define CONTROL_BUFSIZE     100
-#define LIST_BUFSIZE       2000
-#define MAX_FILENAME_LEN     79
-
 #include <stdio.h>                     /* printf etc. */
-#include <stdlib.h>                    /* strtol, malloc */
-#include <string.h>                    /* strncpy, strlen */
+#include <stdlib.h>                    /* malloc */
+#include <string.h>                    /* strlen */
 #include <ctype.h>                     /* tolower */
-#include <dirent.h>
-#include <time.h>                      /* usleep / nanosleep */
-#if defined(__DMC__)
-#include <direct.h>                    /* chdir */
-#else
-#include <unistd.h>                    /* usleep, chdir */
+#include <time.h>                      /* Run time */
+#include <sys/stat.h>
+#if !defined(__DMC__)
+#include <unistd.h>                    /* read, close, gethostname */
 #endif
-
-#if defined(PPDEV)
-
- #include <sys/ioctl.h>
- #include <fcntl.h>                     /* open */
- #include <linux/ppdev.h>               /* Parallel port device */
- int fd;                                /* File descriptor for opened parallel port */
- const char defaultDevice[] = PPDEV;    /* May be overridden with the -d option */
-
-#elif __DMC__
- #if defined(DIRECTIO)
- #include <dos.h>                       /* Direct port access for DOS */
- #else
- #include <windef.h>
- #include <winbase.h>
- HINSTANCE hLib;
- /* prototype (function typedef) for DLL function Inp32: */
- typedef short _stdcall (*inpfuncPtr)(short portaddr);
- typedef void _stdcall (*oupfuncPtr)(short portaddr, short datum);
- inpfuncPtr inp32;
- oupfuncPtr oup32;
- #endif
-#elif defined(RASPIWIRING)
- #include <wiringPi.h>
-#else
- #include <sys/io.h>                    /* Direct port access for Linux */
+#if !defined(S_ISDIR)
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
 #endif
-
+#if defined(__linux__)
+#include <sys/inotify.h>               /* Watch mode */
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
 #endif
 
-#if defined(RASPIWIRING)
-//default GPIO pins
-const unsigned int wiringClkOut = 7; //GPIO07 pin 7
-                                   //GND    pin 9
-const unsigned int wiringBitOut = 0; //GPIO00 pin 11
-const unsigned int wiringClkIn  = 2; //GPIO02 pin 13
-const unsigned int wiringBitIn  = 3; //GPIO03 pin 15
-#endif
+#include "pofo.h"
 
-#if defined(DIRECTIO) && !defined(RASPIWIRING)
-const unsigned short defaultPort = DATAPORT;
-unsigned short dataPort;
-unsigned short statusPort;
-#endif
+#define SCRIPT_LINE_LEN   1024
+#define WATCH_DEBOUNCE_MS  300         /* Quiet time that ends a burst of changes */
+#define WATCH_MAX_FILES    256         /* Changed files sent as one batch */
+#define RECONNECT_MS     10000         /* Time to re-establish the link without -s */
+#define LIST_ENTRY_LEN    (2*FILENAME_MAX) /* Source and destination of a source list entry */
+#define MODEL_PARAMS         3         /* Cost per kilobyte, per block and per file */
+#define MODEL_DECAY        0.9         /* Weight of a run compared to the next one */
+#define MODEL_PRIOR        1.0         /* Weight of the default coefficients */
 
-typedef enum {
-	VERB_QUIET = 0,
-	VERB_ERRORS,
-	VERB_COUNTER,
-	VERB_FLOWCONTROL
-} VERBOSITY;
 
+/*
+	Sources of the command line or of a source list (@FILE)
+*/
+typedef struct {
+	char ** argv;
+	int     argc;
+	int     index;
+	FILE *  list;
+	int     separator;
+	char *  dest;                        /* DEST of the command line */
+	char    entry[LIST_ENTRY_LEN];
+} SOURCES;
 
-int force = 0;
-int sourcecount = 0;
 
-unsigned char * payload;
-unsigned char * controlData;
-unsigned char * list;
+/*
+	Least squares sums of the link model for one direction
+*/
+typedef struct {
+	double xx[MODEL_PARAMS][MODEL_PARAMS];
+	double xy[MODEL_PARAMS];
+	long   runs;
+} LINK_MODEL;
 
+/* Coefficients to start from: seconds per kilobyte, per block and per file */
+static const double modelDefaults[2][MODEL_PARAMS] = {
+	{ 0.40, 0.06, 0.10 },                /* Transmit: sendByte() and sendBlock() pause */
+	{ 0.25, 0.01, 0.10 }                 /* Receive */
+};
 
-unsigned char transmitInit[90] =
-	{ /* Offset 0: Funktion */
-		0x03, 0x00, 0x70, 0x0C, 0x7A, 0x21, 0x32,
-		/* Offset 7: Dateilaenge */
-		0, 0, 0, 0
-		/* Offset 11: Pfad */
-	};
 
-const unsigned char transmitOverwrite[3] = { 0x05, 0x00, 0x70 };
+int force = 0;
+int sourcecount = 0;
+long timeout = 0;                      /* Link timeout in ms, 0 = wait forever */
+char mode = 'h';
 
-const unsigned char transmitCancel[3] = { 0x00, 0x00, 0x00 };
 
+/*
+	Callbacks of the transfer library
+*/
+static void printMessage(void *user, unsigned long id, const char *text)
+{
+	printf("%s\n", text);
+}
 
-unsigned char receiveInit[82] =
-	{ 0x06,         /* Offset 0: Funktion */
-		0x00, 0x70    /* Offset 2: Puffergroesse = 28672 Byte */
-									/* Offset 3: Pfad */
-	};
+static void printFile(void *user, unsigned long id, int index, int count, const char *name)
+{
+	printf("Transferring file %d", index);
+	if (sourcecount == 1) {
+		/* We know the total number of files only if a single source item
+			 has been specified (potentially using wildcards). */
+		printf(" of %d", count);
+	}
+	printf(": %s\n", name);
+}
 
-const unsigned char receiveFinish[3] = { 0x20, 0x00, 0x03 };
+static void printProgress(void *user, unsigned long id, long done, long total)
+{
+	if (mode == 't' || mode == 'w')
+		printf("Sent %ld of %ld bytes.\r", done, total);
+	else
+		printf("Received %ld of %ld bytes\r", done, total);
 
+	if (done == total)
+		printf("\n");
+}
 
-#if defined(PPDEV)
-#include <time.h>
 
 /*
-	Open parallel port. Returns 0 on success
+	Print the error of a failed operation and terminate unless it only
+	affects the current file
 */
-int openPort(const char * device) {
-	fd = open(device, O_RDWR);
-	if (fd == -1) {
-		perror("open");
-		fprintf(stderr, "Try 'modprobe ppdev' and 'chmod 666 %s' as root!\n", device);
-		return -1;
-	}
-
-	fprintf(stderr, "Waiting for %s to become available...\r", device);
-	if (ioctl(fd, PPCLAIM)) {
-		perror("PPCLAIM");
-		close(fd);
-		return -1;
+static void checkStatus(POFO_SESSION *s, POFO_STATUS status)
+{
+	switch (status) {
+	case POFO_OK:
+		return;
+	case POFO_ERR_SKIPPED:
+		fprintf(stderr, "%s\n", pofoErrorText(s));
+		return;
+	case POFO_ERR_EXISTS:
+		printf("%s\nUse -f to force overwriting.\n", pofoErrorText(s));
+		if (mode == 't')
+			return; /* proceed to next file */
+		break;
+	default:
+		fprintf(stderr, "%s\n", pofoErrorText(s));
 	}
-	fprintf(stderr, "%s sucessfully opened.               \r", device);
 
-	return fd;
+	pofoClose(s);
+	exit(EXIT_FAILURE);
 }
 
-#elif defined(RASPIWIRING)
-int openPort() {
-	if (wiringPiSetup () == -1)
-		return -1 ;
-	//configure GPIO pins
-	pinMode(wiringClkIn, INPUT);
-	pinMode(wiringBitIn, INPUT);
-	pinMode(wiringClkOut, OUTPUT);
-	pinMode(wiringBitOut, OUTPUT);
-	return 0;
-}
-#else
 
 /*
-	Get access to I/O port. Returns 0 on success
+	Re-establish the link after an error that leaves it out of step.
+	Returns 0 if the session can go on.
 */
-int openPort(const unsigned short port) {
-	dataPort = port;
-	statusPort = port + 1;
-
-#if defined(__DMC__)
-#if defined(DIRECTIO)
-	return 0;
-#else
-	hLib = LoadLibrary("inpout32.dll");
-	if (hLib == NULL) {
-		fprintf(stderr, "INPOUT32.DLL seems to be missing!\n");
-		return -1;
-	}
-
-	/* get the address of the function */
-	inp32 = (inpfuncPtr) GetProcAddress(hLib, "Inp32");
-	if (inp32 == NULL) {
-		fprintf(stderr, "GetProcAddress for Inp32 Failed.\n");
-		return -1;
-	}
+static int recoverLink(POFO_SESSION *s, POFO_STATUS status)
+{
+	if (status != POFO_ERR_NOT_READY && status != POFO_ERR_ACKNOWLEDGE &&
+			status != POFO_ERR_CHECKSUM && status != POFO_ERR_BUFFER &&
+			status != POFO_ERR_PROTOCOL && status != POFO_ERR_TIMEOUT)
+		return 0;
 
-	oup32 = (oupfuncPtr) GetProcAddress(hLib, "Out32");
-	if (oup32 == NULL) {
-		fprintf(stderr, "GetProcAddress for Oup32 Failed.\n");
+	printf("Re-establishing link...\n");
+	if (pofoConnect(s, timeout ? timeout : RECONNECT_MS) != POFO_OK) {
+		fprintf(stderr, "%s\n", pofoErrorText(s));
 		return -1;
 	}
-#endif
-#else
-	return ioperm(dataPort, 3, 255);
-#endif
+	return 0;
 }
 
-#endif
-
 
 /*
-	Read the status register of the parallel port
+	Read the next entry of a source list (@FILE). Entries end with the
+	separator character and are read one at a time, so the size of the list
+	does not matter. An entry may name its own destination after a TAB,
+	otherwise *entryDest is set to NULL. Returns NULL at the end of the list.
 */
-static inline unsigned char readPort(void) {
-	unsigned char byte;
-#if defined(__DMC__)
-
-#if defined(DIRECTIO)
-	byte = inp(statusPort);
-#else
-	byte = (inp32)(statusPort);
-#endif
-
-#else
+static char * readListEntry(FILE *list, char *entry, const int size, const int separator, char **entryDest)
+{
+	int c, len, tooLong;
+
+	for (;;) {
+		len = 0;
+		tooLong = 0;
+		while ((c = getc(list)) != EOF && c != separator) {
+			if (len < size-1)
+				entry[len++] = c;
+			else
+				tooLong = 1;
+		}
+		if (len && entry[len-1] == '\r' && separator == '\n')
+			len--;
+		entry[len] = 0;
 
-#if defined(PPDEV)
-	ioctl (fd, PPRSTATUS, &byte);
-#elif defined(RASPIWIRING)
-	byte = (digitalRead(wiringClkIn)) << 5 | (digitalRead(wiringBitIn) << 4); 
-#else
-	byte = inb(statusPort);
-#endif
+		if (tooLong) {
+			fprintf(stderr, "Skipping source list entry: %.40s...\n", entry);
+		}
+		else if (len) {
+			char *tab = strchr(entry, '\t');
+			*entryDest = NULL;
+			if (tab) {
+				*tab = 0;
+				if (tab[1])
+					*entryDest = tab+1;
+			}
+			return entry;
+		}
 
-#endif
-	return byte;
+		if (c == EOF)
+			return NULL;
+	}
 }
 
 
 /*
-	Output a byte to the data register of the parallel port
+	Get the next source and its destination. *count tells composePofoName()
+	whether the destination is a directory. Returns 0 after the last source
+	and -1 if a source list entry has no destination.
 */
-static inline void writePort(const unsigned char byte) {
-#if defined(__DMC__)
-
-#if defined(DIRECTIO)
-	outp(dataPort, byte);
-#else
-	(oup32)(dataPort, byte);
-#endif
-
-#else
-
-#if defined(DIRECTIO)
-	outb(byte, dataPort);
-#elif defined(RASPIWIRING)
-	digitalWrite(wiringBitOut, byte & 0x01);
-	digitalWrite(wiringClkOut, (byte >> 1) & 0x01);
-#else
-	ioctl (fd, PPWDATA, &byte);
-#endif
-
-#endif
-}
-
-
-static inline void waitClockHigh(void)
-{
-	unsigned char byte = 0;
-	while (!byte) {
-		byte = readPort() & 0x20;
-	}
-}
-
-static inline void waitClockLow(void)
+static int nextSource(SOURCES *src, char **source, char **target, int *count)
 {
-	unsigned char byte = 1;
-	while (byte) {
-		byte = readPort() & 0x20;
+	*target = src->dest;
+	*count = sourcecount;
+
+	if (src->list) {
+		char * entryDest;
+
+		*source = readListEntry(src->list, src->entry, sizeof(src->entry), src->separator, &entryDest);
+		if (*source == NULL)
+			return 0;
+		if (entryDest) {
+			*target = entryDest;
+			*count = 1;
+		}
+		else if (*target == NULL && mode != 'l') {
+			fprintf(stderr, "No destination for %s\n", *source);
+			return -1;
+		}
+		else {
+			/* DEST is a directory */
+			*count = 2;
+		}
+		return 1;
 	}
-}
-
 
-static inline unsigned char getBit(void)
-{
-	return( (readPort() & 0x10) >> 4 );
+	if (src->index >= src->argc)
+		return 0;
+	*source = src->argv[src->index++];
+	return 1;
 }
 
 
 /*
-	Receives one byte serially, MSB first
-	One bit is read on every falling and every rising slope of the clock signal.
+	Seconds from an arbitrary starting point
 */
-unsigned char receiveByte(void)
+static double seconds(void)
 {
-	int i;
-	unsigned char byte;
-
-	for (i=0; i<4; i++) {
-		waitClockLow();
-		byte = (byte << 1) | getBit();
-		writePort(0);                   /* Clear clock */
-		waitClockHigh();
-		byte = (byte << 1) | getBit();
-		writePort(2);                   /* Set clock */
-	}
-
-	return byte;
+#if defined(__DMC__)
+	return (double)clock() / CLOCKS_PER_SEC;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+#endif
 }
 
 
 /*
-	Transmits one byte serially, MSB first
-	One bit is transmitted on every falling and every rising slope of the clock signal.
+	The link model is kept per host in $HOME/.transfolio-HOST
 */
-void sendByte(unsigned char byte)
+static void modelPath(char *path, const int size)
 {
-	int i;
-	unsigned char b;
+	const char *home = getenv("HOME");
+	char host[64] = "local";
 
 #if defined(__DMC__)
-	/* Should be usleep(50), but smaller arguments than 1000 result in no delay */
-	usleep(1000);
+	if (getenv("COMPUTERNAME"))
+		strncpy(host, getenv("COMPUTERNAME"), sizeof(host)-1);
 #else
-	struct timespec t;
-	t.tv_sec = 0;
-	t.tv_nsec = 50000;
-	nanosleep(&t, NULL);
+	gethostname(host, sizeof(host)-1);
 #endif
-
-	for (i=0; i<4; i++) {
-		b = ((byte & 0x80) >> 7) | 2;     /* Output data bit */
-		writePort(b);
-		b = (byte & 0x80) >> 7;           /* Set clock low   */
-		writePort(b);
-
-		byte = byte << 1;
-		waitClockLow();
-
-		b = (byte & 0x80) >> 7;           /* Output data bit */
-		writePort(b);
-		b = ((byte & 0x80) >> 7) | 2;     /* Set clock high  */
-		writePort(b);
-
-		byte = byte << 1;
-		waitClockHigh();
-	}
+	snprintf(path, size, "%s/.transfolio-%s", home ? home : ".", host);
 }
 
 
 /*
-	This function transmits a block of data.
-	Call int 61h with AX=3002 (open) and AX=3001 (receive) on the Portfolio
+	Load the models for transmitting (0) and receiving (1).
+	Unknown directions start without runs.
 */
-void sendBlock(const unsigned char *pData, const unsigned int len, const VERBOSITY verbosity)
+static void loadModel(LINK_MODEL model[2])
 {
-	unsigned char byte;
-	unsigned int  i;
-	unsigned char lenH, lenL;
-	unsigned char checksum = 0;
-
-	if (len) {
-		byte = receiveByte();
-
-		if (byte == 'Z') {
-			if (verbosity >= VERB_FLOWCONTROL) {
-				printf("Portfolio ready for receiving.\n");
-			}
-		}
-		else {
-			if (verbosity >= VERB_ERRORS) {
-				fprintf(stderr, "Portfolio not ready!\n");
-				exit(EXIT_FAILURE);
-			}
-		}
-
-		usleep(50000);
-		sendByte(0x0a5);
-
-		lenH = len >> 8;
-		lenL = len & 255;
-		sendByte(lenL); checksum -= lenL;
-		sendByte(lenH); checksum -= lenH;
-
-		for (i=0; i<len; i++) {
-			byte = pData[i];
-			sendByte(byte); checksum -= byte;
-
-			if (verbosity >= VERB_COUNTER)
-				printf("Sent %d of %d bytes.\r", i+1, len);
-		}
-		sendByte(checksum);
-
-		if (verbosity >= VERB_COUNTER)
-			printf("\n");
-
-		byte = receiveByte();
+	char path[FILENAME_MAX];
+	char line[512];
+	FILE *file;
+
+	memset(model, 0, 2*sizeof(LINK_MODEL));
+	modelPath(path, sizeof(path));
+	file = fopen(path, "r");
+	if (file == NULL)
+		return;
 
-		if (byte == checksum) {
-			if (verbosity >= VERB_FLOWCONTROL) {
-				fprintf(stderr, "checksum OK\n");
-			}
-		}
-		else {
-			if (verbosity >= VERB_ERRORS) {
-				fprintf(stderr, "checksum ERR: %d\n", byte);
-				exit(EXIT_FAILURE);
-			}
-		}
+	while (fgets(line, sizeof(line), file)) {
+		LINK_MODEL m;
+		char dir;
+		double *xx = &m.xx[0][0];
+
+		if (sscanf(line, "%c %ld %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf", &dir, &m.runs,
+							 &xx[0], &xx[1], &xx[2], &xx[3], &xx[4], &xx[5], &xx[6], &xx[7], &xx[8],
+							 &m.xy[0], &m.xy[1], &m.xy[2]) != 14)
+			continue;
+		if (dir == 't')
+			model[0] = m;
+		else if (dir == 'r')
+			model[1] = m;
 	}
+	fclose(file);
 }
 
 
-/* 
-	 This function receives a block of data and returns its length in bytes.
-	 Call int 61h with AX=3002 (open) and AX=3000 (transmit) on the Portfolio.
-*/
-int receiveBlock(unsigned char *pData, const int maxLen, const VERBOSITY verbosity)
+static void saveModel(const LINK_MODEL model[2])
 {
-	unsigned int len, i;
-	unsigned char lenH, lenL;
-	unsigned char checksum = 0;
-	unsigned char byte;
-
-	sendByte('Z');
+	char path[FILENAME_MAX];
+	FILE *file;
+	int d, i;
 
-	byte = receiveByte();
+	modelPath(path, sizeof(path));
+	file = fopen(path, "w");
+	if (file == NULL)
+		return;
 
-	if (byte == 0x0a5) {
-		if (verbosity >= VERB_FLOWCONTROL) {
-			fprintf(stderr, "Acknowledge OK\n");
-		}
-	}
-	else {
-		if (verbosity >= VERB_ERRORS) {
-			fprintf(stderr, "Acknowledge ERROR (received %2X instead of A5)\n", byte);
-			exit(EXIT_FAILURE);
-		}
+	fprintf(file, "# Transfolio link model: direction, runs, least squares sums\n");
+	for (d=0; d<2; d++) {
+		const double *xx = &model[d].xx[0][0];
+		fprintf(file, "%c %ld", d ? 'r' : 't', model[d].runs);
+		for (i=0; i<MODEL_PARAMS*MODEL_PARAMS; i++)
+			fprintf(file, " %.9g", xx[i]);
+		for (i=0; i<MODEL_PARAMS; i++)
+			fprintf(file, " %.9g", model[d].xy[i]);
+		fprintf(file, "\n");
 	}
+	fclose(file);
+}
 
-	lenL = receiveByte();  checksum += lenL;
-	lenH = receiveByte();  checksum += lenH;
-	len = (lenH << 8) | lenL;
 
-	if (len > maxLen) {
-		if (verbosity >= VERB_ERRORS) {
-			fprintf(stderr, "Receive buffer too small (%d instead of %d bytes).\n", maxLen, len);
-		}
-		return 0;
-	}
+static void modelInput(const POFO_COUNTERS *c, double x[MODEL_PARAMS])
+{
+	x[0] = c->bytes / 1024.0;
+	x[1] = c->frames;
+	x[2] = c->files;
+}
 
-	for (i=0; i<len; i++) {
-		unsigned char byte = receiveByte();
-		checksum += byte;
-		pData[i] = byte;
 
-		if (verbosity >= VERB_COUNTER)
-			printf("Received %d of %d bytes\r", i+1, len);
+/*
+	Fit the coefficients to the measured runs, pulled towards the defaults
+	(ridge regression), and return the predicted time for the counters.
+*/
+static double predictTime(const LINK_MODEL *model, const int dir, const POFO_COUNTERS *c)
+{
+	double a[MODEL_PARAMS][MODEL_PARAMS+1];
+	double x[MODEL_PARAMS];
+	double t = 0;
+	int i, j, k;
+
+	for (i=0; i<MODEL_PARAMS; i++) {
+		for (j=0; j<MODEL_PARAMS; j++)
+			a[i][j] = model->xx[i][j] + (i == j ? MODEL_PRIOR : 0);
+		a[i][MODEL_PARAMS] = model->xy[i] + MODEL_PRIOR * modelDefaults[dir][i];
 	}
 
-	if (verbosity >= VERB_COUNTER)
-		printf("\n");
-
-	byte = receiveByte();
-
-	if ((unsigned char)(256 - byte) == checksum) {
-		if (verbosity >= VERB_FLOWCONTROL) {
-			fprintf(stderr, "checksum OK\n");
+	/* Gaussian elimination with partial pivoting */
+	for (i=0; i<MODEL_PARAMS; i++) {
+		int pivot = i;
+		for (j=i+1; j<MODEL_PARAMS; j++) {
+			if (a[j][i]*a[j][i] > a[pivot][i]*a[pivot][i])
+				pivot = j;
 		}
-	}
-	else {
-		if (verbosity >= VERB_ERRORS) {
-			fprintf(stderr, "checksum ERR %d %d\n",(unsigned char)(256 - byte),checksum);
-			exit(EXIT_FAILURE);
+		for (k=0; k<=MODEL_PARAMS; k++) {
+			double tmp = a[i][k];
+			a[i][k] = a[pivot][k];
+			a[pivot][k] = tmp;
+		}
+		for (j=0; j<MODEL_PARAMS; j++) {
+			double f;
+			if (j == i)
+				continue;
+			f = a[j][i] / a[i][i];
+			for (k=i; k<=MODEL_PARAMS; k++)
+				a[j][k] -= f * a[i][k];
 		}
 	}
 
-	usleep(100);
-	sendByte((unsigned char)(256 - checksum));
-
-	return len;
+	modelInput(c, x);
+	for (i=0; i<MODEL_PARAMS; i++)
+		t += x[i] * a[i][MODEL_PARAMS] / a[i][i];
+	return t > 0 ? t : 0;
 }
 
 
 /*
-	Read source file on PC and transmit it to the Portfolio (/t)
+	Add a measured run to the model. Older runs fade out so that the model
+	follows changes of the cable or the machine.
 */
-void transmitFile(const char * source, const char * dest) {
-	FILE * file = fopen(source, "rb");
-	int val, len, blocksize;
-
-	if (file == NULL) {
-		fprintf(stderr, "File not found: %s\n", source);
-		exit(EXIT_FAILURE);
-	}
-
-	/*
-		Dateigroesse ermitteln
-	*/
-	val = fseek(file, 0, SEEK_END);
-	if (val != 0) {
-		fprintf(stderr, "Seek error!\n");
-		exit(EXIT_FAILURE);
-	}
-	len = ftell(file);
-	if (len == -1 || len > 32*1024*1024) {
-		/* Directories and huge files (>32 MB) are skipped */
-		fprintf(stderr, "Skipping %s.\n", source);
-		return;
-	}
-	val = fseek(file, 0, SEEK_SET);
-	if (val != 0) {
-		fprintf(stderr, "Seek error!\n");
-		exit(EXIT_FAILURE);
+static void updateModel(LINK_MODEL *model, const POFO_COUNTERS *c, const double time)
+{
+	double x[MODEL_PARAMS];
+	int i, j;
+
+	modelInput(c, x);
+	for (i=0; i<MODEL_PARAMS; i++) {
+		for (j=0; j<MODEL_PARAMS; j++)
+			model->xx[i][j] = MODEL_DECAY * model->xx[i][j] + x[i] * x[j];
+		model->xy[i] = MODEL_DECAY * model->xy[i] + x[i] * time;
 	}
+	model->runs++;
+}
 
-	transmitInit[7] = len & 255;
-	transmitInit[8] = (len >> 8) & 255;
-	transmitInit[9] = (len >> 16) & 255;
 
-	strncpy((char*)transmitInit+11, dest, MAX_FILENAME_LEN);
+/*
+	Dry run (/t /e): Show where each source would be sent and how long it
+	is expected to take, without using the Portfolio.
+	Returns -1 if a source list entry has no destination.
+*/
+static int estimateTransmit(SOURCES *src, const LINK_MODEL *model)
+{
+	POFO_COUNTERS total = { 0, 0, 0 };
+	char * source;
+	char * target;
+	int  count, more;
 
-	sendBlock(transmitInit, sizeof(transmitInit), VERB_ERRORS);
-	receiveBlock(controlData, CONTROL_BUFSIZE, VERB_ERRORS);
+	while ((more = nextSource(src, &source, &target, &count)) > 0) {
+		POFO_COUNTERS plan = { 0, 0, 0 };
+		char pofoName[MAX_FILENAME_LEN+1];
+		struct stat st;
 
-	if (controlData[0] == 0x10) {
-		fprintf(stderr, "Invalid destination file!\n");
-		exit(EXIT_FAILURE);
-	}
+		composePofoName(source, target, pofoName, count);
 
-	if (controlData[0] == 0x20) {
-		printf("File exists on Portfolio");
-		if (force) {
-			printf(" and is being overwritten.\n");
-			sendBlock(transmitOverwrite, sizeof(transmitOverwrite), VERB_ERRORS);
+		if (stat(source, &st) != 0) {
+			printf("File not found: %s\n", source);
+			continue;
 		}
-		else {
-			printf("! Use -f to force overwriting.\n");
-			sendBlock(transmitCancel, sizeof(transmitCancel), VERB_ERRORS);
-			return; /* proceed to next file */
+		if (S_ISDIR(st.st_mode) || st.st_size > 32*1024*1024) {
+			printf("Skipping %s.\n", source);
+			continue;
 		}
-	}
 
-	blocksize = controlData[1] + (controlData[2] << 8);
-	if (blocksize > PAYLOAD_BUFSIZE) {
-		fprintf(stderr, "Payload buffer too small!\n");
-		exit(EXIT_FAILURE);
-	}
+		/* With -f, existing files are assumed to be replaced */
+		pofoPlan(POFO_OP_TRANSMIT, st.st_size, force, &plan);
+		printf("%s -> %s: %ld bytes, %ld blocks, %.1f s\n", source, pofoName,
+					 (long)st.st_size, plan.frames, predictTime(model, 0, &plan));
 
-	if (len > blocksize) {
-		printf("Transmission consists of %d blocks of payload.\n", (len+blocksize-1)/blocksize);
-	}
-				int readed;
-	while (len > blocksize) {
-		readed = fread(payload, sizeof(char), blocksize, file);
-		sendBlock(payload, blocksize, VERB_COUNTER);
-		len -= blocksize;
+		total.bytes += plan.bytes;
+		total.frames += plan.frames;
+		total.files += plan.files;
 	}
 
-	readed = fread(payload, sizeof(char), len, file);
-	if (len)
-		sendBlock(payload, len, VERB_COUNTER);
-	receiveBlock(controlData, CONTROL_BUFSIZE, VERB_ERRORS);
-
-	fclose(file);
+	printf("Total: %ld files, %ld bytes in %ld blocks, %.1f s estimated", total.files,
+				 total.bytes, total.frames, predictTime(model, 0, &total));
+	if (model->runs)
+		printf(" (model of %ld runs)\n", model->runs);
+	else
+		printf(" (default model)\n");
 
-	if (controlData[0] != 0x20) {
-		fprintf(stderr, "Transmission failed!\nPossilby disk full on Portfolio or directory does not exist.\n");
-		exit(EXIT_FAILURE);
-	}
+	return more;
 }
 
 
 /*
-	Receive source file(s) from the Portfolio and save it on the PC (/r)
+	Fetch a directory listing and display it
 */
-void receiveFile(const char * source, const char * dest) {
-	static int nReceivedFiles = 0;
-	FILE * file;
-	int i, num, len, total;
-	int destIsDir = 0;
-	int blocksize = 0x7000;   /* TODO: Check if this is always the same */
-	char startdir[256];
-	char *namebase;
-	char *basename;
-	char *pos;
-
-	/* Check if the destination parameter specifies a directory */
-	if (!getcwd(startdir, sizeof(startdir))) {
-		fprintf(stderr, "Unexpected error: getcwd() failed!\n  %s", dest);
-		exit(EXIT_FAILURE);
-	}
-	if (chdir(dest) == 0) {
-		destIsDir = 1;
-	}
+static POFO_STATUS listDirectory(POFO_SESSION *s, const char *pattern)
+{
+	POFO_STATUS status;
+	char * names;
+	char * name;
+	int i, num;
 
-	/* Get list of matching files */
-	receiveInit[0] = 6;
-	strncpy((char*)receiveInit+3, source, MAX_FILENAME_LEN);
-	sendBlock(receiveInit, sizeof(receiveInit), VERB_ERRORS);
-	receiveBlock((unsigned char*)list, 2000, VERB_ERRORS);
+	printf("Fetching directory listing for %s\n", pattern);
+	status = listFiles(s, pattern, &names, &num);
+	if (status != POFO_OK)
+		return status;
 
-	num = list[0] + (list[1] << 8);
+	if (num == 0)
+		printf("No files.\n");
 
-	if (num == 0) {
-		printf("File not found on Portfolio: %s\n", source);
-		exit(EXIT_FAILURE);
+	name = names;
+	for (i=0; i<num; i++) {
+		printf("%s\n", name);
+		name += strlen(name) + 1;
 	}
+	free(names);
+
+	return POFO_OK;
+}
+
 
-	/* Set up pointer to behind the path where basename shall be appended */
-	namebase = (char*)receiveInit+3;
-	pos = strrchr(namebase, ':');
-	if (pos) {
-		namebase = pos + 1;
+/*
+	Split off the next argument of a script line. Arguments are separated
+	by white space and may be enclosed in double quotes. Backslashes have
+	no special meaning as they are part of DOS paths.
+	Returns NULL if there are no more arguments.
+*/
+static char * nextArgument(char **pos)
+{
+	char *p = *pos;
+	char *arg;
+
+	while (isspace((unsigned char)*p))
+		p++;
+	if (!*p)
+		return NULL;
+
+	if (*p == '"') {
+		arg = ++p;
+		while (*p && *p != '"')
+			p++;
 	}
-	pos = strrchr(namebase, '\\');
-	if (pos) {
-		namebase = pos + 1;
+	else {
+		arg = p;
+		while (*p && !isspace((unsigned char)*p))
+			p++;
 	}
 
-	basename = (char*)list + 2;
-
-	/* Transfer each file from the list */
-	for (i=1; i<=num; i++) {
+	if (*p)
+		*p++ = 0;
+	*pos = p;
 
-		printf("Transferring file %d", nReceivedFiles + i);
-		if (sourcecount == 1) {
-			/* We know the total number of files only if a single source item
-				 has been specified (potentially using wildcards). */
-			printf(" of %d", num);
-		}
-		printf(": %s\n", basename);
+	return arg;
+}
 
-		if (destIsDir)
-			dest = basename;
 
-		/* Check if destination file exists */
-		file = fopen(dest, "rb");
-		if (file != NULL) {
-			fclose(file);
-			if (!force) {
-				printf("File exists! Use -f to force overwriting.\n");
-				if (i<num)
-					printf("Remaining files are not copied!\n");
-				exit(EXIT_FAILURE);
-			}
+/*
+	Run the commands of a script in the current session (/b).
+	Every command reports its result, a failing command does not stop
+	the script unless the link is broken. Returns the number of failures.
+
+	Commands:
+	  list PATTERN
+	  get SOURCE DEST           (receive, honours -f)
+	  put SOURCE DEST           (transmit, existing files are kept)
+	  overwrite SOURCE DEST     (transmit, existing files are replaced)
+*/
+static int runScript(POFO_SESSION *s, FILE *script)
+{
+	char line[SCRIPT_LINE_LEN];
+	int lineNo = 0;
+	int failures = 0;
+
+	while (fgets(line, sizeof(line), script)) {
+		POFO_STATUS status;
+		char *pos = line;
+		char *command, *source, *dest;
+
+		lineNo++;
+		line[strcspn(line, "\r\n")] = 0;
+
+		command = nextArgument(&pos);
+		if (!command || command[0] == '#')
+			continue;
+		source = nextArgument(&pos);
+		dest = nextArgument(&pos);
+
+		if (strcmp(command, "list") == 0 && source && !dest) {
+			mode = 'l';
+			status = listDirectory(s, source);
 		}
-
-		/* Open destination file */
-		file = fopen(dest, "wb");
-		if (file == NULL) {
-			fprintf(stderr, "Cannot create file: %s\n", dest);
-			exit(EXIT_FAILURE);
+		else if (strcmp(command, "get") == 0 && source && dest) {
+			mode = 'r';
+			status = receiveFile(s, source, dest, force);
 		}
-
-		/* Request Portfolio to send file */
-		receiveInit[0] = 2;
-		strncpy(namebase, basename, MAX_FILENAME_LEN);
-		sendBlock(receiveInit, sizeof(receiveInit), VERB_ERRORS);
-
-		/* Get file length information */
-		receiveBlock(controlData, CONTROL_BUFSIZE, VERB_ERRORS);
-
-		if (controlData[0] != 0x20) {
-			fprintf(stderr, "Unknown protocol error! \n");
-			exit(EXIT_FAILURE);
+		else if ((strcmp(command, "put") == 0 || strcmp(command, "overwrite") == 0) && source && dest) {
+			char pofoName[MAX_FILENAME_LEN+1];
+			mode = 't';
+			composePofoName(source, dest, pofoName, 1);
+			printf("Transmitting file: %s -> %s\n", source, pofoName);
+			status = transmitFile(s, source, pofoName, command[0] == 'o');
+		}
+		else {
+			printf("[%d] ERROR: Invalid command\n", lineNo);
+			failures++;
+			continue;
 		}
 
-		total = controlData[7] + ((int)controlData[8] << 8) + ((int)controlData[9] << 16);
-
-		if (total > blocksize) {
-			printf("Transmission consists of %d blocks of payload.\n", (total+blocksize-1)/blocksize);
+		if (status == POFO_OK) {
+			printf("[%d] OK\n", lineNo);
 		}
+		else {
+			printf("[%d] ERROR: %s\n", lineNo, pofoErrorText(s));
+			failures++;
 
-		/* Receive and save actual payload */
-		while(total > 0) {
-			len = receiveBlock(payload, PAYLOAD_BUFSIZE, VERB_COUNTER);
-			fwrite(payload, 1, len, file);
-			total -= len;
+			/* The link is out of step after a protocol error */
+			if (recoverLink(s, status) != 0) {
+				printf("Script aborted.\n");
+				break;
+			}
 		}
+	}
 
-		/* Close connection and destination file */
-		sendBlock(receiveFinish, sizeof(receiveFinish), VERB_ERRORS);
-		fclose(file);
+	mode = 'b';
+	return failures;
+}
 
-		basename += strlen(basename) + 1;
-	}
 
-	/* Change back to original directory */
-	if (destIsDir) {
-		if (chdir(startdir) != 0) {
-			fprintf(stderr, "Unexpected error: chdirs(%s) failed!\n", startdir);
-			exit(EXIT_FAILURE);
-		}
-	}
+#if defined(__linux__)
+
+static volatile sig_atomic_t stopWatching = 0;
 
-	nReceivedFiles += num;
+static void onSignal(int sig)
+{
+	stopWatching = 1;
 }
 
 
 /*
-	Get directory listing from the Portfolio and display it (/l)
+	Send the changed files collected by watchDirectory().
+	Returns -1 if the link cannot be recovered.
 */
-void listFiles(const char * pattern) {
-	int i, num;
-	char *name;
-
-	printf("Fetching directory listing for %s\n", pattern);
+static int sendChanged(POFO_SESSION *s, const char *dir, char *dest,
+											 char changed[][FILENAME_MAX], const int nChanged)
+{
+	int i;
 
-	strncpy((char*)receiveInit+3, pattern, MAX_FILENAME_LEN);
-	sendBlock(receiveInit, sizeof(receiveInit), VERB_ERRORS);
-	receiveBlock(payload, PAYLOAD_BUFSIZE, VERB_ERRORS);
+	for (i=0; i<nChanged; i++) {
+		char source[FILENAME_MAX];
+		char pofoName[MAX_FILENAME_LEN+1];
+		struct stat st;
+		POFO_STATUS status;
 
-	num = payload[0] + (payload[1] << 8);
-	if (num == 0)
-		printf("No files.\n");
+		snprintf(source, sizeof(source), "%s/%s", dir, changed[i]);
+		if (stat(source, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
 
-	name = (char*)payload + 2;
+		composePofoName(changed[i], dest, pofoName, 2);
+		printf("Transmitting changed file: %s -> %s\n", source, pofoName);
 
-	for (i=0; i<num; i++) {
-		printf("%s\n", name);
-		name += strlen(name) + 1;
+		status = transmitFile(s, source, pofoName, 1);
+		if (status != POFO_OK) {
+			fprintf(stderr, "%s\n", pofoErrorText(s));
+			if (recoverLink(s, status) != 0)
+				return -1;
+		}
 	}
+
+	return 0;
 }
 
 
 /*
-	Assemble full destination path and name if only the destination directory is given.
-	The current source file name is appended to the destination directory and modified
-	to fulfill the (most important) DOS file naming restrictions.
+	Watch a directory and send every file that has been written to the
+	Portfolio (/w). A burst of changes is collected until the directory has
+	been quiet for WATCH_DEBOUNCE_MS, so a file that is saved several times
+	is only sent once. Runs until interrupted.
 */
-void composePofoName(char *source, char * dest, char *pofoName, int sourcecount)
+static void watchDirectory(POFO_SESSION *s, int fd, const char *dir, char *dest)
 {
-	char *pos;
-	char *ext;
-	char  lastChar;
+	static char changed[WATCH_MAX_FILES][FILENAME_MAX];
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd;
+	int nChanged = 0;
+	int i;
 
-	/* Exchange Slash by Backslash (Unix path -> DOS path) */
-	while (pos = strchr(dest, '/')) {
-		*pos = '\\';
-	}
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
 
-	strncpy(pofoName, dest, MAX_FILENAME_LEN);
+	printf("Watching %s, press Ctrl-C to stop.\n", dir);
 
-	lastChar = pofoName[strlen(pofoName)-1];
+	while (!stopWatching) {
+		/* Wait without timeout for the first change, then until the burst is over */
+		int ready = poll(&pfd, 1, nChanged ? WATCH_DEBOUNCE_MS : -1);
 
-	if (sourcecount > 1 || lastChar == '\\' || lastChar ==':') {
-		/* "dest" is a directory. */
-		int len;
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
 
-		/* Append Backslash: */
-		if (lastChar != '\\')
-			strncat(pofoName, "\\", MAX_FILENAME_LEN-strlen(pofoName));
+		if (ready > 0) {
+			ssize_t len = read(fd, buf, sizeof(buf));
+			char *pos;
 
-		/* Skip path part in source: */
-		pos = strrchr(source, '/');
-		if (!pos)
-			pos = strrchr(source, '\\');
-		if (pos)
-			source = pos+1;
+			for (pos = buf; len > 0 && pos < buf + len; ) {
+				const struct inotify_event *event = (const struct inotify_event *)pos;
+				pos += sizeof(struct inotify_event) + event->len;
 
-		ext = strrchr(source, '.');
-		if (ext) {
-			/* Replace dots before extension by underscores */
-			while ((pos = strchr(source, '.')) != ext) {
-				*pos = '_';
+				/* Skip hidden files and editor backups */
+				if (!event->len || event->name[0] == '.' ||
+						event->name[strlen(event->name)-1] == '~')
+					continue;
+
+				for (i=0; i<nChanged; i++) {
+					if (strcmp(changed[i], event->name) == 0)
+						break;
+				}
+				if (i < nChanged)
+					continue;
+
+				/* Table full: send what has been collected and go on with the rest */
+				if (nChanged == WATCH_MAX_FILES) {
+					if (sendChanged(s, dir, dest, changed, nChanged) != 0) {
+						stopWatching = 1;
+						break;
+					}
+					nChanged = 0;
+				}
+				strncpy(changed[nChanged], event->name, FILENAME_MAX-1);
+				nChanged++;
 			}
 
-			/* Append file name without extension: */
-			len = ext-source;
-			if (len > 8)
-				len = 8;
-			if (len > MAX_FILENAME_LEN-strlen(pofoName))
-				len = MAX_FILENAME_LEN-strlen(pofoName);
-			strncat(pofoName, source, len);
-
-			/* Append file name extension */
-			len = 4;
-			if (len > MAX_FILENAME_LEN-strlen(pofoName))
-				len = MAX_FILENAME_LEN-strlen(pofoName);
-			strncat(pofoName, ext, len);
-		}
-		else {
-			/* There is no extension */
-			len = 8;
-			if (len > MAX_FILENAME_LEN-strlen(pofoName))
-				len = MAX_FILENAME_LEN-strlen(pofoName);
-			strncat(pofoName, source, len);
+			continue;
 		}
+
+		/* Quiet period is over: send the collected files */
+		if (sendChanged(s, dir, dest, changed, nChanged) != 0)
+			stopWatching = 1;
+		nChanged = 0;
 	}
+
+	printf("Watching stopped.\n");
 }
 
+#endif
+
 
 int main(int argc, char* argv[])
 {
 #if defined(PPDEV)
-	const char * device = defaultDevice;
+	const char * device = PPDEV;
 #elif defined(RASPIWIRING)
-	//TODO?
+	const char * device = NULL;
 #else
-	unsigned short port = defaultPort;
+	const char * device = NULL;
+	int portArg = 0;
 #endif
+	int  timeoutArg = 0;
+	int  samplesArg = 0;
+	int  storeArg = 0;
+	char * store = NULL;
+	int  samples = POFO_SAMPLES;
+	static const POFO_CALLBACKS callbacks = { printMessage, printFile, printProgress };
+	POFO_SESSION * session;
+	FILE * archive = NULL;
+	FILE * script = NULL;
+	char * scriptName = NULL;
+	int  watchFd = -1;
 	char ** sourcelist = NULL;
 	char * dest = NULL;
-	unsigned char byte;
-	char mode = 'h';
+	SOURCES sources;
+	LINK_MODEL model[2];
+	POFO_COUNTERS counters;
+	char * source;
+	char * target;
+	int  count, more;
+	int  listed;
+	int  dryRun = 0;
+	double startTime;
+	int  useArchive = 0;
+	int  textMode = 0;
 	int  i, j;
 
 
-	printf("Transfolio 1.0 - (c) 2018 by Klaus Peichl\n");
+	printf("Transfolio 1.1 - (c) 2018 by Klaus Peichl\n");
+
+	memset(&sources, 0, sizeof(sources));
+	sources.separator = '\n';
 
 	/*
 		Command line parsing: Get source, destination, mode and the force flag
 	*/
 	for (i=1; i<argc; i++) {
-		if (argv[i][0]=='-'
+		if ((argv[i][0]=='-' && argv[i][1])     /* a single '-' stands for stdin */
 #if defined(__DMC__)
 				|| argv[i][0]=='/'
 #endif
@@ -883,11 +870,39 @@ int main(int argc, char* argv[])
 				case 't':
 				case 'r':
 				case 'l':
+				case 'b':
+#if defined(__linux__)
+				case 'w':
+#endif
 					mode = letter;
 					break;
 				case 'f':
 					force = 1;
 					break;
+				case 'a':
+					useArchive = 1;
+					break;
+				case '0':
+					sources.separator = 0;
+					break;
+				case 'e':
+					dryRun = 1;
+					break;
+				case 'x':
+					textMode |= POFO_TEXT_LINES;
+					break;
+				case 'c':
+					textMode |= POFO_TEXT_CP437;
+					break;
+				case 's':
+					timeoutArg = 1; /* the next argument is the timeout in seconds */
+					break;
+				case 'n':
+					samplesArg = 1; /* the next argument is the number of samples */
+					break;
+				case 'k':
+					storeArg = 1;   /* the next argument is the backup store */
+					break;
 #if defined(PPDEV)
 				case 'd':
 					device = NULL;  /* the next argument is used as the device name */
@@ -896,7 +911,7 @@ int main(int argc, char* argv[])
 					//TODO: param for wired: pin list
 #else
 				case 'p':
-					port = 0;       /* the next argument is used as the port address */
+					portArg = 1;    /* the next argument is used as the port address */
 					break;
 #endif
 				default:
@@ -906,6 +921,19 @@ int main(int argc, char* argv[])
 		}
 		else {
 			/* Command line argument */
+			if (timeoutArg) {
+				timeout = strtol(argv[i], NULL, 10) * 1000;
+				timeoutArg = 0;
+			}
+			else if (samplesArg) {
+				samples = strtol(argv[i], NULL, 10);
+				samplesArg = 0;
+			}
+			else if (storeArg) {
+				store = argv[i];
+				storeArg = 0;
+			}
+			else
 #if defined(PPDEV)
 			if (!device) {
 				device = argv[i];
@@ -914,13 +942,16 @@ int main(int argc, char* argv[])
 #elif defined(RASPIWIRING)
 					//TODO: parse pin list for wired
 #else
-			if (!port) {
-				char * endptr;
-				port = strtol(argv[i], &endptr, 0);
+			if (portArg) {
+				device = argv[i];
+				portArg = 0;
 			}
 			else
 #endif
-			if (!sourcelist) {
+			if (mode == 'b' && !scriptName) {
+				scriptName = argv[i];
+			}
+			else if (!sourcelist) {
 				sourcelist = argv+i;
 				sourcecount = 1;
 			}
@@ -935,13 +966,23 @@ int main(int argc, char* argv[])
 	}
 
 
+	/* A single source starting with '@' names a source list */
+	listed = sourcecount == 1 && sourcelist[0][0] == '@' &&
+		(mode == 't' || mode == 'r' || mode == 'l');
+
+
 	/*
 		Show help screen in case of an invalid command line
 	*/
 	if ((mode == 'h') ||
-			(mode == 't' && dest == NULL) ||
-			(mode == 'r' && dest == NULL) ||
-			(mode == 'l' && sourcelist == NULL)
+			(mode == 't' && dest == NULL && !listed) ||
+			(mode == 'r' && dest == NULL && (!listed || useArchive)) ||
+			(mode == 'l' && sourcelist == NULL) ||
+			(mode == 'l' && useArchive) ||
+			(mode == 'b' && (scriptName == NULL || sourcelist || useArchive)) ||
+			(mode == 'w' && (sourcecount != 1 || dest == NULL || useArchive)) ||
+			(dryRun && (mode != 't' || useArchive || (textMode & POFO_TEXT_LINES))) ||
+			(store && (mode != 'r' || useArchive || textMode))
 			) {
 		printf("\nSyntax: %s "
 #if defined(PPDEV)
@@ -951,7 +992,38 @@ int main(int argc, char* argv[])
 #else
 					 "[-p ADR] "
 #endif
-					 "[-f] {-t|-r} SOURCE DEST \n", argv[0]);
+					 "[-s SECONDS] [-n SAMPLES] "
+					 "[-f] [-a] [-x] [-c] [-e] {-t|-r} SOURCE DEST \n", argv[0]);
+		printf("  or    %s "
+#if defined(PPDEV)
+					 "[-d DEVICE] "
+#elif defined(RASPIWIRING)
+					//TODO: param for wired: pin list
+#else
+					 "[-p ADR] "
+#endif
+					 "[-s SECONDS] [-n SAMPLES] "
+					 "[-f] -k STORE -r SOURCE SNAPSHOT \n", argv[0]);
+		printf("  or    %s "
+#if defined(PPDEV)
+					 "[-d DEVICE] "
+#elif defined(RASPIWIRING)
+					//TODO: param for wired: pin list
+#else
+					 "[-p ADR] "
+#endif
+					 "[-s SECONDS] [-n SAMPLES] "
+					 "[-f] [-a] [-x] [-c] [-e] [-0] {-t|-r|-l} @FILE [DEST] \n", argv[0]);
+		printf("  or    %s "
+#if defined(PPDEV)
+					 "[-d DEVICE] "
+#elif defined(RASPIWIRING)
+					//TODO: param for wired: pin list
+#else
+					 "[-p ADR] "
+#endif
+					 "[-s SECONDS] [-n SAMPLES] "
+					 "-l PATTERN \n", argv[0]);
 		printf("  or    %s "
 #if defined(PPDEV)
 					 "[-d DEVICE] "
@@ -960,7 +1032,21 @@ int main(int argc, char* argv[])
 #else
 					 "[-p ADR] "
 #endif
-					 "-l PATTERN \n\n", argv[0]);
+					 "[-s SECONDS] [-n SAMPLES] "
+					 "[-f] [-x] [-c] -b SCRIPT \n", argv[0]);
+#if defined(__linux__)
+		printf("  or    %s "
+#if defined(PPDEV)
+					 "[-d DEVICE] "
+#elif defined(RASPIWIRING)
+					//TODO: param for wired: pin list
+#else
+					 "[-p ADR] "
+#endif
+					 "[-s SECONDS] [-n SAMPLES] "
+					 "[-x] [-c] -w DIRECTORY DEST \n", argv[0]);
+#endif
+		printf("\n");
 		printf("-t  Transmit file(s) to Portfolio.\n");
 		printf("    Wildcards are not directly supported but may be expanded\n");
 		printf("    by the shell to generate a list of source files.\n");
@@ -968,105 +1054,247 @@ int main(int argc, char* argv[])
 		printf("    Wildcards in SOURCE are evaluated by the Portfolio.\n");
 		printf("    In a Unix like shell, quoting is required.\n");
 		printf("-l  List directory files on Portfolio matching PATTERN \n");
+		printf("-b  Run the commands in SCRIPT (- for stdin) in one session:\n");
+		printf("      list PATTERN\n");
+		printf("      get SOURCE DEST\n");
+		printf("      put SOURCE DEST\n");
+		printf("      overwrite SOURCE DEST\n");
+		printf("    Each command reports OK or ERROR, errors do not stop the script.\n");
+#if defined(__linux__)
+		printf("-w  Watch DIRECTORY and send each file to the DEST directory on\n");
+		printf("    the Portfolio when it has been changed. Runs until Ctrl-C.\n");
+#endif
 		printf("-f  Force overwriting an existing file \n");
+		printf("-a  Archive mode: With -t, SOURCE is a list of tar archives whose\n");
+		printf("    members are sent to the DEST directory. With -r, all received\n");
+		printf("    files are written into the tar archive DEST.\n");
+		printf("-x  Text mode: Convert line endings from LF to CRLF when transmitting\n");
+		printf("    and from CRLF to LF when receiving.\n");
+		printf("-c  Convert characters between ISO 8859-1 and code page 437.\n");
+		printf("    Files received into a tar archive are never converted.\n");
+		printf("-k  Backup mode: Each received file is stored once per content in the\n");
+		printf("    STORE directory. The SNAPSHOT directory links to the stored files.\n");
+		printf("    Files are stored unchanged, so -x and -c cannot be used.\n");
+		printf("-e  Dry run: Show the files that -t would send and the time it is\n");
+		printf("    expected to take according to the times of previous runs.\n");
+		printf("    Cannot be combined with -x, which changes the file lengths.\n");
+		printf("-s  Give up if the Portfolio does not respond within SECONDS\n");
+		printf("    (default: wait forever).\n");
+		printf("-n  Port reads required for a clock edge and votes per data bit\n");
+		printf("    (default: %d, 1 = no filtering).\n", POFO_SAMPLES);
 #if defined(PPDEV)
-		printf("-d  Select parallel port device (default: %s) \n", defaultDevice);
+		printf("-d  Select parallel port device (default: %s) \n", PPDEV);
 #elif defined(RASPIWIRING)
 					//TODO: param for wired: pin list
 #else
-		printf("-p  Select parallel port address (default: 0x%x) \n", defaultPort);
+		printf("-p  Select parallel port address (default: 0x%x) \n", DATAPORT);
 #endif
 		printf("\nNotes:\n");
 		printf("- SOURCE may be a single file or a list of files.\n");
 		printf("  In the latter case, DEST specifies a directory.\n");
+		printf("- @FILE reads the sources from FILE (- for stdin), one per line or\n");
+		printf("  NUL separated with -0. DEST is a directory then. An entry may\n");
+		printf("  name its own destination after a TAB.\n");
 		printf("- The Portfolio must be in server mode when running this program!\n");
 		exit(EXIT_FAILURE);
 	}
 
 
 	/*
-		Memory allocation
+		Session allocation
 	*/
-	payload = malloc(PAYLOAD_BUFSIZE);
-	controlData = malloc(CONTROL_BUFSIZE);
-	list = malloc(LIST_BUFSIZE);
+	session = pofoCreate();
 
-	if (payload == NULL || controlData == NULL || list == NULL) {
+	if (session == NULL) {
 		fprintf(stderr, "Out of memory!\n");
 		exit(EXIT_FAILURE);
 	}
 
+	pofoSetCallbacks(session, &callbacks, NULL);
+	pofoSetTextMode(session, textMode);
+	pofoSetSamples(session, samples);
+
+
+	/*
+		Create the destination archive before occupying the Portfolio
+	*/
+	if (useArchive && mode == 'r') {
+		archive = fopen(dest, "rb");
+		if (archive != NULL) {
+			fclose(archive);
+			if (!force) {
+				printf("File exists! Use -f to force overwriting.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		archive = fopen(dest, "wb");
+		if (archive == NULL) {
+			fprintf(stderr, "Cannot create file: %s\n", dest);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+
+	/*
+		Open the script before occupying the Portfolio
+	*/
+	if (mode == 'b') {
+		script = strcmp(scriptName, "-") == 0 ? stdin : fopen(scriptName, "r");
+		if (script == NULL) {
+			fprintf(stderr, "File not found: %s\n", scriptName);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+
+	/*
+		Open the source list before occupying the Portfolio
+	*/
+	sources.argv = sourcelist;
+	sources.argc = sourcecount;
+	sources.dest = dest;
+	if (listed) {
+		const char *listName = sourcelist[0]+1;
+		sources.list = strcmp(listName, "-") == 0 ? stdin : fopen(listName, "rb");
+		if (sources.list == NULL) {
+			fprintf(stderr, "File not found: %s\n", listName);
+			exit(EXIT_FAILURE);
+		}
+		/* The number of sources is unknown */
+		sourcecount = 0;
+	}
+
+	loadModel(model);
+	if (dryRun) {
+		exit(estimateTransmit(&sources, &model[0]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+
+#if defined(__linux__)
+	/*
+		Set up the directory watch before occupying the Portfolio
+	*/
+	if (mode == 'w') {
+		watchFd = inotify_init();
+		if (watchFd == -1 ||
+				inotify_add_watch(watchFd, sourcelist[0], IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+			perror(sourcelist[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+
 
 	/*
 		Open the parallel port
 	*/
-	if (openPort(
 #if defined(PPDEV)
-			device
-#elif defined(RASPIWIRING)
-					//TODO: pin list for wired (struct)
-#else
-			port
+	fprintf(stderr, "Waiting for %s to become available...\r", device);
 #endif
-		) == -1) {
+	if (pofoOpen(session, device) != POFO_OK) {
+		fprintf(stderr, "%s\n", pofoErrorText(session));
 		fprintf(stderr, "Cannot open parallel port!\n");
 		exit(EXIT_FAILURE);
 	}
+#if defined(PPDEV)
+	fprintf(stderr, "%s sucessfully opened.               \r", device);
+#endif
 
 
 	/*
 		Wait for Portfolio to enter server mode
 	*/
 	fprintf(stderr, "Waiting for Portfolio...                           \r");
-	writePort(2);
-	waitClockHigh();
-	byte = receiveByte();
-	/* synchronization */
-	while (byte != 90) {
-		waitClockLow();
-		writePort(0);
-		waitClockHigh();
-		writePort(2);
-		byte = receiveByte();
-	}
+	pofoSetTimeout(session, timeout);
+	checkStatus(session, pofoConnect(session, timeout));
 
 
 	/*
 		Call subroutine depending on the mode of operation
 	*/
-	for (i=0; i<sourcecount; i++)
-	switch (mode) {
-	case 't':
-		{
-			char pofoName[MAX_FILENAME_LEN+1];
-			composePofoName(sourcelist[i], dest, pofoName, sourcecount);
-			printf("Transmitting file %d of %d: %s -> %s\n", i+1, sourcecount, sourcelist[i], pofoName);
-			transmitFile(sourcelist[i], pofoName);
+	startTime = seconds();
+	i = 0;
+	while ((more = nextSource(&sources, &source, &target, &count)) > 0) {
+		i++;
+		switch (mode) {
+		case 't':
+			if (useArchive) {
+				checkStatus(session, transmitArchive(session, source, target, force));
+			}
+			else {
+				char pofoName[MAX_FILENAME_LEN+1];
+				composePofoName(source, target, pofoName, count);
+				if (sourcecount)
+					printf("Transmitting file %d of %d: %s -> %s\n", i, sourcecount, source, pofoName);
+				else
+					printf("Transmitting file %d: %s -> %s\n", i, source, pofoName);
+				checkStatus(session, transmitFile(session, source, pofoName, force));
+			}
+			break;
+		case 'r':
+			if (archive)
+				checkStatus(session, receiveArchive(session, source, archive));
+			else if (store)
+				checkStatus(session, receiveStore(session, source, store, target, force));
+			else
+				checkStatus(session, receiveFile(session, source, target, force));
+			break;
+		case 'l':
+			checkStatus(session, listDirectory(session, source));
 			break;
 		}
-	case 'r':
-		receiveFile(sourcelist[i], dest);
-		break;
-	case 'l':
-		listFiles(sourcelist[i]);
-		break;
 	}
 
+	if (sources.list && sources.list != stdin)
+		fclose(sources.list);
+	if (more < 0) {
+		pofoClose(session);
+		exit(EXIT_FAILURE);
+	}
 
-#if defined(PPDEV)
-	/*
-		Close the parallel port device
-	*/
-	ioctl(fd, PPRELEASE);
-	close(fd);
-#endif
+	/* Compare the run time with the estimate and let the model learn from it */
+	pofoGetCounters(session, &counters);
+	if ((mode == 't' || mode == 'r') && counters.files) {
+		LINK_MODEL *m = &model[mode == 'r'];
+		double time = seconds() - startTime;
+
+		printf("Transfer took %.1f s (estimated: %.1f s).\n", time, predictTime(m, mode == 'r', &counters));
+		updateModel(m, &counters, time);
+		saveModel(model);
+	}
+
+	if (script) {
+		int failures = runScript(session, script);
 
-#if defined(RASPIWIRING)
-	pinMode(wiringBitOut, INPUT);
-	pinMode(wiringClkOut, INPUT);
-#elif defined(__DMC__) && !defined(DIRECTIO)
-	FreeLibrary(hLib);
+		if (script != stdin)
+			fclose(script);
+		if (failures) {
+			printf("%d command(s) failed.\n", failures);
+			pofoClose(session);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+#if defined(__linux__)
+	if (watchFd != -1) {
+		watchDirectory(session, watchFd, sourcelist[0], dest);
+		close(watchFd);
+	}
 #endif
 
+	if (archive) {
+		closeTarArchive(archive);
+	}
+
+	if (pofoGlitches(session)) {
+		printf("%lu glitches on the link have been filtered.\n", pofoGlitches(session));
+	}
+
+
+	/*
+		Close the parallel port
+	*/
+	pofoClose(session);
+
 	return(0);
 }